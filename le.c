@@ -38,6 +38,8 @@
  */
 #ifdef __linux__
 #define _POSIX_C_SOURCE 200809L
+/* copy_file_range */
+#define _GNU_SOURCE
 #endif
 
 #include <termios.h>
@@ -51,6 +53,23 @@
 #include <time.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*  ================ DEFINES  ================ */
 
@@ -66,11 +85,13 @@
 #define DISABLE_ALT_SCREEN_SZ 8
 /* from the obscure depths of the internet
  * https://invisible-island.net/xterm/ctlseqs/ctlseqs.html#h2-Mouse-Tracking
+ * 1006 has reports come as SGR-style decimals, not bytes that run out
+ * past column 223
  */
-#define ENABLE_MOUSE_TRACKING "\x1b[?1000h"
-#define DISABLE_MOUSE_TRACKING "\x1b[?1000l"
-#define ENABLE_MOUSE_TRACKING_SZ 8
-#define DISABLE_MOUSE_TRACKING_SZ 8
+#define ENABLE_MOUSE_TRACKING "\x1b[?1000h\x1b[?1006h"
+#define DISABLE_MOUSE_TRACKING "\x1b[?1006l\x1b[?1000l"
+#define ENABLE_MOUSE_TRACKING_SZ 16
+#define DISABLE_MOUSE_TRACKING_SZ 16
 /* http://vt100.net/docs/vt510-rm/DECTCEM.html */
 #define HIDE_CURSOR "\x1b[?25l"
 #define HIDE_CURSOR_SZ 6
@@ -128,6 +149,29 @@
 #define DEL_FORWARD_CHAR 1003 // delete (fn+<delete> on macOS)
 #define DEL_BACKWARD_CHAR 127 // backspace (<delete> on macOS)
 
+#define GOTO_PREFIX 1004 // M-g
+
+#define KILL_LINE CTRL('K')
+#define UNDO CTRL('_') // or C-/ or C-x u
+#define REDO 1005 // M-_ or C-M-_
+
+#define UNIVERSAL_ARG CTRL('U')
+/* what C-x e leaves as the previous key, so e alone calls it again */
+#define KBD_MACRO_AGAIN 1006
+
+/* where is in the mouse global */
+#define MOUSE_WHEEL 1007
+#define MOUSE_CLICK 1008
+/* releases, drags and the other buttons */
+#define MOUSE_OTHER 1009
+
+/* lines a notch of the mouse wheel scrolls, and how much further it goes
+   when turned fast: a burst within WHEEL_ACCEL_MS of the one before goes
+   twice as far, up to WHEEL_ACCEL_MAX times */
+#define WHEEL_LINES 3
+#define WHEEL_ACCEL_MS 80
+#define WHEEL_ACCEL_MAX 8
+
 /* ================ initializers ================ */
 
 #define ABUF_INIT { 0, NULL }
@@ -195,6 +239,20 @@
 
 /* ================ GLOBALS ================ */
 
+/* ================ long rows ================ */
+
+/* rows this long are never rendered whole, only their chunks on screen */
+#define ROW_LONG_SZ (64 * 1024)
+#define ROW_CHUNK_SZ 4096
+
+struct row_chunk
+{
+  /* first byte of the chunk within chars, never mid-character */
+  int off;
+  /* column the chunk starts in */
+  int col;
+};
+
 /* ================ editor state ================ */
 
 struct editor_row
@@ -203,12 +261,41 @@ struct editor_row
   int size;
   /* size of the rendered chars on screen */
   int rsize;
-  /* the actual chars */
+  /* columns the rendered chars take up */
+  int rcols;
+  /* column each byte of render starts in, NULL if it's all ASCII */
+  int *rcol;
+  /* for very long rows, which get no render at all */
+  struct row_chunk *chunk;
+  int num_chunks;
+  /* visual lines when wrapped, and the window width that was for */
+  int wrap_lines;
+  int wrap_width;
+  /* highlight of each render byte, NULL until the row is drawn */
+  unsigned char *hl;
+  /* lexer state at the end of the row */
+  unsigned char hl_state;
+  /* needs lexing again, hl (if any) is from a guess */
+  bool hl_stale;
+  /* where the row starts within the (decompressed) file */
+  off_t off;
+  /* bytes of line terminator after it in the file */
+  int eol;
+  /* changed since it was read, off means nothing then */
+  bool dirty;
+  /* the actual chars, NULL while a compressed row is not loaded */
   char *chars;
   /* the rendered chars */
   char *render;
 };
 
+/* a run of rows, and the visual lines they take when wrapped */
+struct wrap_block
+{
+  int rows;
+  int lines;
+};
+
 struct editor_state_struct
 {
   /* restore upon exit */
@@ -223,11 +310,53 @@ struct editor_state_struct
   time_t status_msg_time;
   /* how many rows do we have of text */
   int num_rows;
+  /* how many rows we have room for */
+  int row_cap;
+  /* decompressor state, NULL unless the file is compressed */
+  struct gz_file *gz;
+  /* the mapped file, NULL unless it's shown in hex */
+  struct hex_file *hex;
+  /* the file the clean rows came from, kept open for saving */
+  int fd;
+  /* what it looked like then, to tell if someone else wrote it */
+  off_t file_size;
+  struct timespec file_mtime;
+  dev_t file_dev;
+  ino_t file_ino;
+  /* changed since it was read or saved */
+  bool dirty;
+  /* rows changed so far, to tell if a command did anything */
+  unsigned long edits;
+  /* terminator a new line break gets, the one the first line had */
+  int eol;
   /* how many rows up top are we missing (scrolling) */
   int row_offset;
   /* how many cols to the left missing (scrolling) */
   int col_offset;
 
+  /* soft wrap instead of horizontal scrolling */
+  bool wrap;
+  /* visual lines of the top row scrolled past */
+  int wrap_offset;
+  /* rows in blocks, and Fenwick trees over the rows and the visual
+     lines of the blocks, 1-indexed */
+  struct wrap_block *wrap_block;
+  int *wrap_row_tree;
+  int *wrap_tree;
+  int wrap_blocks;
+  int wrap_block_cap;
+  /* num_rows the blocks account for, -1 to build them again */
+  int wrap_tree_rows;
+
+  /* how to highlight the file, NULL for not at all */
+  struct editor_syntax *syntax;
+  /* rows before this have the right hl_state */
+  int hl_valid_to;
+  /* rows before this that aren't stale did, before the latest edits */
+  int hl_known_to;
+  /* rows this redraw may still lex */
+  int hl_budget;
+
   /* cursor position -- within the chars field of the editor rows */
   int cx, cy;
   /* cursor position -- within the render field of editor rows,
@@ -242,6 +371,49 @@ struct editor_state_struct
 
 const char *progname;
 
+/* set by SIGWINCH, acted on between keys */
+volatile sig_atomic_t window_resized;
+
+/* the keys of the last keyboard macro */
+struct kbd_macro
+{
+  int *keys;
+  int len;
+  int cap;
+  bool recording;
+  /* keys come from keys[at] instead of the terminal */
+  bool replaying;
+  int at;
+  /* a command rang the bell, which stops replay */
+  bool failed;
+} macro;
+
+/* the last mouse report worth acting on */
+struct mouse_event
+{
+  /* cell clicked, from 0 */
+  int x, y;
+  /* lines the wheel scrolled, negative for up */
+  int lines;
+} mouse;
+
+/* terminal input read before it was asked for */
+struct input_ahead
+{
+  char buf[256];
+  int len;
+  int at;
+  /* have read_n stop at the end of buf instead of reading more */
+  bool only;
+} ahead;
+
+/* defined with the input, output and initialization */
+void editor_set_status_msg(const char *fmt, ...);
+void editor_process_keystroke(void);
+void editor_scroll(void);
+void editor_refresh_screen(void);
+void update_window_size(void);
+
 /* ================ append buffer ================ */
 
 struct abuf
@@ -295,6 +467,47 @@ editor_clear_screen(void)
 	die(DIE_ERROR_FMT, "write");
 }
 
+/* when a file was last modified, to the nanosecond where the system
+   keeps that */
+struct timespec
+stat_mtime(const struct stat *st)
+{
+#if defined(__APPLE__)
+  return st->st_mtimespec;
+#elif defined(__linux__)
+  return st->st_mtim;
+#else
+  return (struct timespec) { .tv_sec = st->st_mtime };
+#endif
+}
+
+bool
+mtime_same(const struct stat *st, struct timespec mtime)
+{
+  struct timespec t = stat_mtime(st);
+  return t.tv_sec == mtime.tv_sec && t.tv_nsec == mtime.tv_nsec;
+}
+
+/* remember what the file looked like when we read or wrote it */
+void
+editor_file_seen(const struct stat *st)
+{
+  editor.file_size = st->st_size;
+  editor.file_mtime = stat_mtime(st);
+  editor.file_dev = st->st_dev;
+  editor.file_ino = st->st_ino;
+}
+
+/* whether it still does, to the nanosecond */
+bool
+editor_file_same(const struct stat *st)
+{
+  return st->st_size == editor.file_size
+    && mtime_same(st, editor.file_mtime)
+    && st->st_dev == editor.file_dev
+    && st->st_ino == editor.file_ino;
+}
+
 /* ================ terminal control ================ */
 
 void
@@ -341,20 +554,157 @@ enable_raw_mode(void)
 int
 read_n(char *cp, int n)
 {
+  int got = 0;
+  while (got < n && ahead.at < ahead.len)
+    cp[got++] = ahead.buf[ahead.at++];
+  if (got == n || ahead.only)
+    return got;
   int nread;
-  nread = read(STDIN_FILENO, cp, n);
+  nread = read(STDIN_FILENO, cp + got, n - got);
   if (nread != -1)
-    return nread;
+    return got + nread;
   die(DIE_ERROR_FMT, "failed reading input");
 }
 
+/* add what the terminal already has for us to ahead, without waiting */
+void
+read_ahead(void)
+{
+  if (ahead.at > 0)
+    {
+      memmove(ahead.buf, &ahead.buf[ahead.at], ahead.len - ahead.at);
+      ahead.len -= ahead.at;
+      ahead.at = 0;
+    }
+  struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+  if (ahead.len < (int) sizeof(ahead.buf) && poll(&pfd, 1, 0) == 1)
+    {
+      int nread = read(STDIN_FILENO, &ahead.buf[ahead.len],
+                       sizeof(ahead.buf) - ahead.len);
+      if (nread > 0)
+        ahead.len += nread;
+    }
+}
+
+/* the rest of a mouse report after ESC [ < (sgr) or ESC [ M, false if
+   it's cut short or garbled */
+bool
+mouse_read_report(bool sgr, int *button, int *x, int *y, bool *press)
+{
+  if (! sgr)
+    {
+      /* each a byte, offset by 32, and coordinates from 1 */
+      unsigned char b[3];
+      if (read_n((char *) b, 3) != 3)
+        return false;
+      *button = b[0] - 32;
+      *x = b[1] - 33;
+      *y = b[2] - 33;
+      /* no telling which button went up */
+      *press = (*button & 3) != 3;
+      return true;
+    }
+
+  int v[3] = { 0 }, i = 0;
+  char c;
+  while (read_n(&c, 1) == 1)
+    if (c >= '0' && c <= '9' && v[i] < 100000)
+      v[i] = v[i] * 10 + c - '0';
+    else if (c == ';' && i < 2)
+      i++;
+    else if ((c == 'M' || c == 'm') && i == 2)
+      {
+        *button = v[0];
+        *x = v[1] - 1;
+        *y = v[2] - 1;
+        *press = c == 'M';
+        return true;
+      }
+    else
+      return false;
+  return false;
+}
+
+/* a turn of the wheel, one notch up (-1) or down (1). a flick sends a
+   burst of these, every one already here is taken in with it so the
+   lot scrolls in one go, and bursts close after each other go further
+   each time */
 int
-editor_read_key(void)
+mouse_wheel(int notch)
+{
+  static struct timespec last;
+  static int accel = 1;
+
+  int notches = notch;
+  while (1)
+    {
+      read_ahead();
+      int at = ahead.at;
+      char *p = &ahead.buf[at];
+      int button, x, y;
+      bool press;
+      if (ahead.len - at < 3 || p[0] != '\x1b' || p[1] != '['
+          || (p[2] != '<' && p[2] != 'M'))
+        break;
+      ahead.at += 3;
+      ahead.only = true;
+      bool ok = mouse_read_report(p[2] == '<', &button, &x, &y, &press);
+      ahead.only = false;
+      if (! ok || (button & ~1) != 64)
+        {
+          /* not ours, leave it for the next key */
+          ahead.at = at;
+          break;
+        }
+      notches += button & 1 ? 1 : -1;
+    }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (now.tv_sec - last.tv_sec) * 1000
+    + (now.tv_nsec - last.tv_nsec) / 1000000;
+  last = now;
+  if (ms < WHEEL_ACCEL_MS)
+    accel = accel * 2 > WHEEL_ACCEL_MAX ? WHEEL_ACCEL_MAX : accel * 2;
+  else
+    accel = 1;
+  mouse.lines = notches * WHEEL_LINES * accel;
+  return MOUSE_WHEEL;
+}
+
+/* what a mouse report after ESC [ < or ESC [ M comes to */
+int
+mouse_read(bool sgr)
+{
+  int button, x, y;
+  bool press;
+  if (! mouse_read_report(sgr, &button, &x, &y, &press))
+    return MOUSE_OTHER;
+  /* 64 and 65 are the wheel, 66 and up sideways ones */
+  if ((button & ~1) == 64)
+    return mouse_wheel(button & 1 ? 1 : -1);
+  /* the left button, not dragged or with shift and such */
+  if (button == 0 && press)
+    {
+      mouse.x = x;
+      mouse.y = y;
+      return MOUSE_CLICK;
+    }
+  return MOUSE_OTHER;
+}
+
+int
+editor_read_terminal_key(void)
 {
   char c;
   
   while ( read_n(&c, 1) != 1 )
-    ;
+    if (window_resized)
+      {
+        window_resized = 0;
+        update_window_size();
+        editor_refresh_screen();
+      }
   
   if (c == '\x1b')
 	{
@@ -373,6 +723,11 @@ editor_read_key(void)
           return BEG_OF_BUF;
         case '>':
           return END_OF_BUF;
+        case 'g':
+          return GOTO_PREFIX;
+        case '_':
+        case CTRL('_'):
+          return REDO;
         }
 	  
 	  if (read_n(&seq[1], 1) != 1)
@@ -381,6 +736,8 @@ editor_read_key(void)
 
 	  if (seq[0] == '[')
 		{
+		  if (seq[1] == '<')
+            return mouse_read(true);
 		  if (seq[1] >= '0' && seq[1] <= '9')
 			{
 			  if (read_n(&seq[2], 1) != 1)
@@ -423,18 +780,8 @@ editor_read_key(void)
 			  case 'F':
 				return END_OF_BUF;
               case 'M':
-                {
-                  /* scrolling with term mode 1000 */
-                  char scroll[3];
-                  if (read_n(scroll, 3) != 3)
-                    return '\x1b';
-                  if (scroll[0] == 96)
-                    return PREV_LINE;
-                  else if (scroll[0] == 97)
-                    return NEXT_LINE;
-                  else
-                    return '\x1b';
-                }
+                /* term mode 1000, for terminals without 1006 */
+                return mouse_read(false);
 			  }
 		}
 	  else if (seq[0] == '0')
@@ -451,9 +798,54 @@ editor_read_key(void)
 	  return '\x1b';
 	}
 
+  return (unsigned char) c;
+}
+
+/* the next key, from a macro being replayed or the terminal */
+int
+editor_read_key(void)
+{
+  if (macro.replaying)
+    {
+      if (macro.at < macro.len)
+        return macro.keys[macro.at++];
+      /* a command wants more than was recorded, have it quit */
+      macro.failed = true;
+      return CTRL('G');
+    }
+
+  int c;
+  do
+    c = editor_read_terminal_key();
+  while (c == MOUSE_OTHER);
+  /* what a click or the wheel does depends on the screen at the time,
+     which a macro won't see again */
+  if (macro.recording && c != MOUSE_CLICK && c != MOUSE_WHEEL)
+    {
+      if (macro.len == macro.cap)
+        {
+          int cap = macro.cap ? macro.cap * 2 : 64;
+          int *keys = realloc(macro.keys, sizeof *keys * cap);
+          if (keys == NULL)
+            die(DIE_ERROR_FMT, "realloc");
+          macro.keys = keys;
+          macro.cap = cap;
+        }
+      macro.keys[macro.len++] = c;
+    }
   return c;
 }
 
+/* ring the bell, which is also how a command fails a macro */
+void
+editor_ding(void)
+{
+  if (macro.replaying)
+    macro.failed = true;
+  else
+    write(STDOUT_FILENO, "\a", 1);
+}
+
 int
 get_cursor_position(int *rows, int *cols)
 {
@@ -514,154 +906,3839 @@ get_window_size(int *rows, int *cols)
 	}
 }
 
+/* ================ utf-8 ================ */
+
+/* code points that take no column of their own */
+static const uint32_t utf8_zero_width[][2] = {
+  { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+  { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+  { 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+  { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0900, 0x0902 },
+  { 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+  { 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0e31, 0x0e31 },
+  { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff },
+  { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+  { 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+  { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef },
+};
+
+/* https://www.cl.cam.ac.uk/~mgk25/ucs/wcwidth.c, locale independent */
+int
+utf8_width(uint32_t cp)
+{
+  if (cp < 0x0300)
+    return 1;
+
+  int lo = 0;
+  int hi = sizeof(utf8_zero_width) / sizeof(utf8_zero_width[0]) - 1;
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (cp > utf8_zero_width[mid][1])
+        lo = mid + 1;
+      else if (cp < utf8_zero_width[mid][0])
+        hi = mid - 1;
+      else
+        return 0;
+    }
+
+  if (cp >= 0x1100
+      && (cp <= 0x115f                         /* hangul jamo */
+          || cp == 0x2329 || cp == 0x232a
+          || (cp >= 0x2e80 && cp <= 0xa4cf && cp != 0x303f) /* cjk .. yi */
+          || (cp >= 0xac00 && cp <= 0xd7a3)    /* hangul syllables */
+          || (cp >= 0xf900 && cp <= 0xfaff)    /* cjk compatibility */
+          || (cp >= 0xfe10 && cp <= 0xfe19)    /* vertical forms */
+          || (cp >= 0xfe30 && cp <= 0xfe6f)    /* cjk compatibility forms */
+          || (cp >= 0xff00 && cp <= 0xff60)    /* fullwidth forms */
+          || (cp >= 0xffe0 && cp <= 0xffe6)
+          || (cp >= 0x1f300 && cp <= 0x1f64f)  /* emoji */
+          || (cp >= 0x1f900 && cp <= 0x1f9ff)
+          || (cp >= 0x20000 && cp <= 0x2fffd)
+          || (cp >= 0x30000 && cp <= 0x3fffd)))
+    return 2;
+  return 1;
+}
+
+/* length of the well-formed sequence at s, 0 if it isn't one */
+int
+utf8_decode(const char *s, int len, uint32_t *cp)
+{
+  const unsigned char *u = (const unsigned char *) s;
+  int n;
+  uint32_t min;
+
+  if (u[0] < 0x80)
+    {
+      *cp = u[0];
+      return 1;
+    }
+  else if ((u[0] & 0xe0) == 0xc0)
+    {
+      n = 2;
+      min = 0x80;
+      *cp = u[0] & 0x1f;
+    }
+  else if ((u[0] & 0xf0) == 0xe0)
+    {
+      n = 3;
+      min = 0x800;
+      *cp = u[0] & 0x0f;
+    }
+  else if ((u[0] & 0xf8) == 0xf0)
+    {
+      n = 4;
+      min = 0x10000;
+      *cp = u[0] & 0x07;
+    }
+  else
+    return 0;
+
+  if (n > len)
+    return 0;
+  for (int i = 1; i < n; i++)
+    {
+      if ((u[i] & 0xc0) != 0x80)
+        return 0;
+      *cp = (*cp << 6) | (u[i] & 0x3f);
+    }
+  /* overlong, surrogate or out of range */
+  if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff))
+    return 0;
+  return n;
+}
+
+#define UTF8_CONT(c) (((unsigned char) (c) & 0xc0) == 0x80)
+/* U+0080 to U+009F, which terminals may take for CSI, OSC and the like.
+   shown a '?' per byte, like a broken sequence */
+#define UTF8_C1(cp) ((cp) >= 0x80 && (cp) < 0xa0)
+
+/* most rows are plain ASCII and never need decoding,
+   check 16 bytes at a time where SSE2 is around */
+bool
+is_ascii(const char *s, int len)
+{
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16)
+    acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (s + i)));
+  if (_mm_movemask_epi8(acc))
+    return false;
+#else
+  uint64_t acc = 0;
+  for (; i + 8 <= len; i += 8)
+    {
+      uint64_t word;
+      memcpy(&word, s + i, sizeof(word));
+      acc |= word;
+    }
+  if (acc & 0x8080808080808080ULL)
+    return false;
+#endif
+  for (; i < len; i++)
+    if ((unsigned char) s[i] & 0x80)
+      return false;
+  return true;
+}
+
 /* ================ row ops ================ */
 
+/* columns that chars[from, to) take when starting at column col */
+int
+editor_row_scan(struct editor_row *row, int from, int to, int col)
+{
+  if (memchr(&row->chars[from], '\t', to - from) == NULL
+      && is_ascii(&row->chars[from], to - from))
+    return col + to - from;
+
+  for (int i = from; i < to; )
+    {
+      uint32_t cp;
+      int n;
+      if (row->chars[i] == '\t')
+        {
+          col += TAB_STOP_SZ - col % TAB_STOP_SZ;
+          i++;
+        }
+      else if ((unsigned char) row->chars[i] < 0x80)
+        {
+          col++;
+          i++;
+        }
+      else if ((n = utf8_decode(&row->chars[i], row->size - i, &cp)) == 0
+               || UTF8_C1(cp))
+        {
+          col++;
+          i++;
+        }
+      else
+        {
+          col += utf8_width(cp);
+          i += n;
+        }
+    }
+  return col;
+}
+
+/* last chunk starting at or before cx (by_col false) or rx (true) */
+struct row_chunk *
+editor_row_find_chunk(struct editor_row *row, int at, bool by_col)
+{
+  int lo = 0, hi = row->num_chunks - 1;
+  while (lo < hi)
+    {
+      int mid = (lo + hi + 1) / 2;
+      if ((by_col ? row->chunk[mid].col : row->chunk[mid].off) <= at)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+  return &row->chunk[lo];
+}
+
+/* render is chars with tabs expanded and bad UTF-8 bytes replaced
+   one for one, so only tabs move us around in it */
 int
 editor_row_cx_to_rx(struct editor_row *row, int cx)
 {
-  int rx = 0;
-  for (int i = 0; i < cx; i++, rx++)
+  if (row->chunk)
+    {
+      struct row_chunk *chunk = editor_row_find_chunk(row, cx, false);
+      return editor_row_scan(row, chunk->off, cx, chunk->col);
+    }
+
+  if (row->rcol == NULL)
+    {
+      int rx = 0;
+      for (int i = 0; i < cx; i++, rx++)
+        if (row->chars[i] == '\t')
+          rx += (TAB_STOP_SZ - 1) - (rx % TAB_STOP_SZ);
+      return rx;
+    }
+
+  int ri = 0;
+  for (int i = 0; i < cx; i++)
     if (row->chars[i] == '\t')
-      rx += (TAB_STOP_SZ - 1) - (rx % TAB_STOP_SZ);
-  return rx;
+      ri += TAB_STOP_SZ - row->rcol[ri] % TAB_STOP_SZ;
+    else
+      ri++;
+  return row->rcol[ri];
+}
+
+/* the char that covers column rx, or the end of the row */
+int
+editor_row_rx_to_cx(struct editor_row *row, int rx)
+{
+  if (row->chunk)
+    {
+      struct row_chunk *chunk = editor_row_find_chunk(row, rx, true);
+      int cx = chunk->off, col = chunk->col;
+      while (cx < row->size)
+        {
+          int next = cx + 1;
+          while (next < row->size && UTF8_CONT(row->chars[next]))
+            next++;
+          int next_col = editor_row_scan(row, cx, next, col);
+          if (next_col > rx)
+            break;
+          cx = next;
+          col = next_col;
+        }
+      return cx;
+    }
+
+  int cx = 0, ri = 0;
+  while (cx < row->size)
+    {
+      int next = cx + 1;
+      while (next < row->size && UTF8_CONT(row->chars[next]))
+        next++;
+      for (int i = cx; i < next; i++)
+        if (row->chars[i] == '\t')
+          ri += TAB_STOP_SZ - (row->rcol ? row->rcol[ri] : ri) % TAB_STOP_SZ;
+        else
+          ri++;
+      if ((row->rcol ? row->rcol[ri] : ri) > rx)
+        break;
+      cx = next;
+    }
+  return cx;
 }
 
+/* index a long row by chunks instead of rendering it */
+void
+editor_chunk_row(struct editor_row *row)
+{
+  row->chunk = malloc(sizeof *row->chunk
+                      * (row->size / ROW_CHUNK_SZ + 1));
+  if (row->chunk == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+
+  int k = 0, col = 0;
+  for (int i = 0; i < row->size; k++)
+    {
+      int end = i + ROW_CHUNK_SZ < row->size ? i + ROW_CHUNK_SZ : row->size;
+      while (end < row->size && UTF8_CONT(row->chars[end]))
+        end++;
+      row->chunk[k].off = i;
+      row->chunk[k].col = col;
+      col = editor_row_scan(row, i, end, col);
+      i = end;
+    }
+  row->num_chunks = k;
+  row->rsize = 0;
+  row->rcols = col;
+}
 
 void
 editor_update_row(struct editor_row *row)
 {
+  free(row->render);
+  free(row->rcol);
+  free(row->chunk);
+  free(row->hl);
+  row->render = NULL;
+  row->hl = NULL;
+  row->rcol = NULL;
+  row->chunk = NULL;
+  row->num_chunks = 0;
+  if (row->size >= ROW_LONG_SZ)
+    {
+      editor_chunk_row(row);
+      return;
+    }
+
   /* specially render tabs */
   int tabs = 0;
   for (int i = 0; i < row->size; i++)
     if (row->chars[i] == '\t')
       tabs++;
   
-  free(row->render);
   // 1 already exists for each tab
   row->render = malloc(row->size + tabs*(TAB_STOP_SZ - 1) +1);
 
   int idx = 0;
-  for (int i = 0; i < row->size; i++)
+  if (is_ascii(row->chars, row->size))
+    {
+      for (int i = 0; i < row->size; i++)
+        {
+          if (row->chars[i] == '\t')
+            {
+              row->render[idx++] = ' ';
+              while (idx % TAB_STOP_SZ != 0)
+                row->render[idx++] = ' ';
+            }
+          else if (iscntrl((unsigned char) row->chars[i]))
+            /* a stray '\r' would send the cursor back to the margin */
+            row->render[idx++] = '?';
+          else
+            row->render[idx++] = row->chars[i];
+        }
+      row->render[idx] = '\0';
+      row->rsize = row->rcols = idx;
+      return;
+    }
+
+  /* bytes and columns part ways, remember where each byte lands */
+  row->rcol = malloc(sizeof *row->rcol
+                     * (row->size + tabs*(TAB_STOP_SZ - 1) + 1));
+  if (row->render == NULL || row->rcol == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+
+  int col = 0;
+  for (int i = 0; i < row->size; )
     {
+      uint32_t cp;
+      int n;
       if (row->chars[i] == '\t')
         {
-          row->render[idx++] = ' ';
-          while (idx % TAB_STOP_SZ != 0)
-            row->render[idx++] = ' ';
+          do
+            {
+              row->rcol[idx] = col++;
+              row->render[idx++] = ' ';
+            }
+          while (col % TAB_STOP_SZ != 0);
+          i++;
+        }
+      else if (iscntrl((unsigned char) row->chars[i])
+               || (n = utf8_decode(&row->chars[i], row->size - i, &cp)) == 0
+               || UTF8_C1(cp))
+        {
+          /* never send the terminal a broken sequence, or a control */
+          row->rcol[idx] = col++;
+          row->render[idx++] = '?';
+          i++;
         }
       else
-        row->render[idx++] = row->chars[i];
+        {
+          for (int k = 0; k < n; k++)
+            {
+              row->rcol[idx] = col;
+              row->render[idx++] = row->chars[i++];
+            }
+          col += utf8_width(cp);
+        }
     }
-  
+
+  row->rcol[idx] = col;
   row->render[idx] = '\0';
   row->rsize = idx;
+  row->rcols = col;
 }
 
-void
-editor_append_row(char *unterminated_s, size_t len)
+/* first byte of render starting at or after column col */
+int
+editor_row_col_to_ri(struct editor_row *row, int col)
 {
-  editor.row = realloc(editor.row,
-							  sizeof *editor.row
-							  * (editor.num_rows + 1));
-  if (editor.row == NULL)
-	die(DIE_ERROR_FMT, "realloc");
-  
-  int new_row = editor.num_rows;
-  editor.row[new_row].size = len;
-  editor.row[new_row].chars = malloc(len + 1);
-  if (editor.row[new_row].chars == NULL)
-	die(DIE_ERROR_FMT, "malloc");
-  
-  memcpy(editor.row[new_row].chars, unterminated_s, len);
-  editor.row[new_row].chars[len] = '\0';
-
-  editor.row[new_row].rsize = 0;
-  editor.row[new_row].render = NULL;
-  editor_update_row(&editor.row[new_row]);
-  
-  editor.num_rows++;
+  if (row->rcol == NULL)
+    return col < row->rsize ? col : row->rsize;
+  int lo = 0, hi = row->rsize;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (row->rcol[mid] < col)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
 }
 
-/* ================ file i/o ================ */
+struct editor_row *
+editor_new_row(void)
+{
+  if (editor.num_rows == editor.row_cap)
+    {
+      int cap = editor.row_cap ? editor.row_cap * 2 : 64;
+      struct editor_row *new_row = realloc(editor.row,
+                                           sizeof *editor.row * cap);
+      if (new_row == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+      editor.row = new_row;
+      editor.row_cap = cap;
+    }
+  struct editor_row *row = &editor.row[editor.num_rows++];
+  memset(row, 0, sizeof *row);
+  row->wrap_lines = 1;
+  return row;
+}
 
-// maybe add a simple UTF-8 check ... do not support :)
-// and make POSIXly
 void
-editor_open(char *filename)
+editor_append_row(char *unterminated_s, size_t len, off_t off)
 {
-  free(editor.filename);
-  editor.filename = strdup(filename);
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-	die(DIE_ERROR_FMT, "fopen");
+  struct editor_row *row = editor_new_row();
+  row->size = len;
+  row->off = off;
+  row->chars = malloc(len + 1);
+  if (row->chars == NULL)
+	die(DIE_ERROR_FMT, "malloc");
   
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+  memcpy(row->chars, unterminated_s, len);
+  row->chars[len] = '\0';
 
-  while (
-		 (linelen = getline(&line, &linecap, fp)) != -1)
-	{
-	  // TODO: figure out display if last line doesn't have `\n`,
-      // just EOF (edge case)
-	  while (linelen > 0
-			 && (line[linelen - 1] == '\n' ||
-				 line[linelen - 1] == '\r'))
-		linelen--;
-	  editor_append_row(line, linelen);
-	}
-  if (line == NULL)
-	die(DIE_ERROR_FMT, "getline");
-  free(line);
-  fclose(fp);
+  row->rsize = 0;
+  row->render = NULL;
+  row->rcol = NULL;
+  row->chunk = NULL;
+  editor_update_row(row);
 }
-	  
-/* ================ input ================ */
 
+/* take over a malloc'd line instead of copying it, for long rows */
 void
-editor_set_status_msg(const char *fmt, ...)
+editor_adopt_row(char *s, size_t len, off_t off)
 {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(editor.status_msg,
-            sizeof(editor.status_msg),
-            fmt,
-            ap);
-  va_end(ap);
-  editor.status_msg_time = time(NULL);
+  struct editor_row *row = editor_new_row();
+  row->size = len;
+  row->off = off;
+  /* getline leaves slack, give it back */
+  row->chars = realloc(s, len + 1);
+  if (row->chars == NULL)
+    die(DIE_ERROR_FMT, "realloc");
+  row->chars[len] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->rcol = NULL;
+  row->chunk = NULL;
+  editor_update_row(row);
 }
 
-void
-editor_move_cursor(int c)
+/* ================ compressed files ================ */
+
+/* gzip files are never held in memory whole. one pass over the file
+ * records the row boundaries along with a checkpoint of the inflate
+ * state every GZ_SPAN decompressed bytes (the zran.c technique from the
+ * zlib examples), after which rows are decompressed on demand starting
+ * from the nearest checkpoint. */
+
+/* decompressed bytes between checkpoints */
+#define GZ_SPAN (1 << 20)
+/* deflate's sliding window, which a checkpoint must carry */
+#define GZ_WINSIZE 32768
+#define GZ_CHUNK 16384
+/* decompressed pages kept for loading rows */
+#define GZ_PAGE_SZ (64 * 1024)
+#define GZ_NUM_PAGES 16
+/* bytes of loaded rows before off-screen ones are dropped again */
+#define GZ_ROW_CACHE_SZ (8 * 1024 * 1024)
+
+struct gz_point
 {
-  // get the row the cursor is on
-  // can be one row past the end, >= vs. ==
-  struct editor_row *row =
-	(editor.cy >= editor.num_rows) ?
-	NULL : &editor.row[editor.cy];
-	
-  switch (c)
-	{
+  /* offset within the decompressed stream */
+  off_t out;
+  /* offset of the first full compressed byte */
+  off_t in;
+  /* bits of the byte before `in' still needed */
+  int bits;
+  /* the last 32K of output, NULL if a gzip member header starts here */
+  unsigned char *window;
+};
+
+struct gz_page
+{
+  /* decompressed offset of the page, -1 if unused */
+  off_t off;
+  int len;
+  /* for picking the least recently used page */
+  unsigned long stamp;
+  unsigned char *data;
+};
+
+struct gz_file
+{
+  FILE *fp;
+  struct gz_point *points;
+  int num_points;
+  struct gz_page pages[GZ_NUM_PAGES];
+  unsigned long clock;
+  /* rows currently holding chars, and how many bytes they take */
+  int *loaded;
+  int num_loaded;
+  int loaded_cap;
+  size_t loaded_bytes;
+  /* the data went bad partway, rows stop where it did */
+  bool corrupt;
+};
+
+void
+gz_add_point(struct gz_file *gz, off_t in, off_t out, int bits,
+             const unsigned char *window, unsigned left)
+{
+  struct gz_point *points = realloc(gz->points, sizeof *gz->points
+                                    * (gz->num_points + 1));
+  if (points == NULL)
+    die(DIE_ERROR_FMT, "realloc");
+  gz->points = points;
+
+  struct gz_point *point = &gz->points[gz->num_points++];
+  point->in = in;
+  point->out = out;
+  point->bits = bits;
+  point->window = NULL;
+  if (window == NULL)
+    return;
+
+  point->window = malloc(GZ_WINSIZE);
+  if (point->window == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  /* the output buffer is circular, unroll it oldest byte first */
+  if (left)
+    memcpy(point->window, window + GZ_WINSIZE - left, left);
+  if (left < GZ_WINSIZE)
+    memcpy(point->window + left, window, GZ_WINSIZE - left);
+}
+
+/* decompress the whole file once, dropping the output but keeping
+   checkpoints and a row stub for every line we pass */
+void
+gz_build_index(struct gz_file *gz)
+{
+  z_stream strm = { 0 };
+  unsigned char input[GZ_CHUNK];
+  unsigned char window[GZ_WINSIZE];
+
+  /* 47: detect a gzip or zlib header */
+  if (inflateInit2(&strm, 47) != Z_OK)
+    die(DIE_MSG_FMT, "inflateInit2 failed");
+
+  off_t totin = 0, totout = 0, last = 0;
+  off_t line_start = 0;
+  int prev = '\n';
+  int ret = Z_OK;
+  bool member_end = false;
+  int members = 0;
+
+  strm.avail_out = 0;
+  do
+    {
+      strm.avail_in = fread(input, 1, GZ_CHUNK, gz->fp);
+      if (ferror(gz->fp))
+        die(DIE_ERROR_FMT, "fread");
+      if (strm.avail_in == 0)
+        break;
+      strm.next_in = input;
+
+      while (strm.avail_in != 0)
+        {
+          if (member_end)
+            {
+              /* concatenated members, common with rotated logs */
+              inflateReset(&strm);
+              member_end = false;
+              if (totout - last > GZ_SPAN)
+                {
+                  gz_add_point(gz, totin, totout, 0, NULL, 0);
+                  last = totout;
+                }
+            }
+
+          if (strm.avail_out == 0)
+            {
+              strm.avail_out = GZ_WINSIZE;
+              strm.next_out = window;
+            }
+
+          unsigned char *from = strm.next_out;
+          totin += strm.avail_in;
+          totout += strm.avail_out;
+          ret = inflate(&strm, Z_BLOCK);
+          totin -= strm.avail_in;
+          totout -= strm.avail_out;
+
+          /* split what we just got into rows */
+          off_t at = totout - (strm.next_out - from);
+          for (unsigned char *p = from; p < strm.next_out; )
+            {
+              unsigned char *nl = memchr(p, '\n', strm.next_out - p);
+              if (nl == NULL)
+                {
+                  prev = strm.next_out[-1];
+                  break;
+                }
+              off_t nl_off = at + (nl - from);
+              int cr = (nl > from ? nl[-1] : prev) == '\r';
+              struct editor_row *row = editor_new_row();
+              row->off = line_start;
+              row->size = nl_off - line_start - cr;
+              row->eol = 1 + cr;
+              row->rsize = 0;
+              row->chars = row->render = NULL;
+              row->rcol = NULL;
+              row->chunk = NULL;
+              line_start = nl_off + 1;
+              prev = '\n';
+              p = nl + 1;
+            }
+
+          if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR
+              || (ret == Z_DATA_ERROR && gz->num_points == 0))
+            die(DIE_MSG_FMT, "corrupt compressed file");
+          if (ret == Z_DATA_ERROR)
+            {
+              /* trailing garbage is fine after a complete member, as
+                 long as it doesn't look like the start of one. bad
+                 data anywhere else means we don't have all of it */
+              if (members == 0 || strm.total_out != 0)
+                gz->corrupt = true;
+              break;
+            }
+          if (ret == Z_STREAM_END)
+            {
+              members++;
+              member_end = true;
+              continue;
+            }
+
+          /* at the end of a deflate block all of its output has been
+             delivered and we can restart from here, bit 64 means it was
+             the last block of the member */
+          if ((strm.data_type & 128) && !(strm.data_type & 64)
+              && (gz->num_points == 0 || totout - last > GZ_SPAN))
+            {
+              gz_add_point(gz, totin, totout, strm.data_type & 7,
+                           window, strm.avail_out);
+              last = totout;
+            }
+        }
+    }
+  while (ret != Z_DATA_ERROR);
+
+  /* last line without a newline */
+  if (totout > line_start)
+    {
+      struct editor_row *row = editor_new_row();
+      row->off = line_start;
+      row->size = totout - line_start;
+      row->rsize = 0;
+      row->chars = row->render = NULL;
+      row->rcol = NULL;
+      row->chunk = NULL;
+    }
+
+  inflateEnd(&strm);
+  if (gz->num_points == 0)
+    die(DIE_MSG_FMT, "corrupt compressed file");
+  if (gz->corrupt)
+    editor_set_status_msg("Compressed data is corrupt after line %d, "
+                          "the rest is missing", editor.num_rows);
+}
+
+/* get more compressed input, returns false at end of file */
+bool
+gz_fill(struct gz_file *gz, z_stream *strm, unsigned char *input)
+{
+  if (strm->avail_in != 0)
+    return true;
+  strm->avail_in = fread(input, 1, GZ_CHUNK, gz->fp);
+  if (ferror(gz->fp))
+    die(DIE_ERROR_FMT, "fread");
+  strm->next_in = input;
+  return strm->avail_in != 0;
+}
+
+/* decompress len bytes at offset into buf, starting from the closest
+   checkpoint, returns how many bytes there were */
+int
+gz_extract(struct gz_file *gz, off_t offset, unsigned char *buf, int len)
+{
+  int lo = 0, hi = gz->num_points - 1;
+  while (lo < hi)
+    {
+      int mid = (lo + hi + 1) / 2;
+      if (gz->points[mid].out <= offset)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+  struct gz_point *here = &gz->points[lo];
+
+  z_stream strm = { 0 };
+  unsigned char input[GZ_CHUNK];
+  unsigned char discard[GZ_WINSIZE];
+  /* raw deflate from a block boundary, gzip from a member header */
+  bool raw = here->window != NULL;
+  if (inflateInit2(&strm, raw ? -15 : 31) != Z_OK)
+    die(DIE_MSG_FMT, "inflateInit2 failed");
+
+  if (fseeko(gz->fp, here->in - (here->bits ? 1 : 0), SEEK_SET) == -1)
+    die(DIE_ERROR_FMT, "fseeko");
+  if (here->bits)
+    {
+      int ch = getc(gz->fp);
+      if (ch == EOF)
+        die(DIE_MSG_FMT, "compressed file changed");
+      inflatePrime(&strm, here->bits, ch >> (8 - here->bits));
+    }
+  if (raw)
+    inflateSetDictionary(&strm, here->window, GZ_WINSIZE);
+
+  off_t skip = offset - here->out;
+  int got = 0;
+  bool next_member = false;
+  while (got < len)
+    {
+      gz_fill(gz, &strm, input);
+      if (skip > 0)
+        {
+          strm.next_out = discard;
+          strm.avail_out = skip > GZ_WINSIZE ? GZ_WINSIZE : skip;
+        }
+      else
+        {
+          strm.next_out = buf + got;
+          strm.avail_out = len - got;
+        }
+      unsigned want = strm.avail_out;
+      int ret = inflate(&strm, Z_NO_FLUSH);
+      if (skip > 0)
+        skip -= want - strm.avail_out;
+      else
+        got += want - strm.avail_out;
+
+      if (ret == Z_STREAM_END)
+        {
+          /* raw inflate stops short of the 8 byte gzip trailer */
+          for (int trailer = raw ? 8 : 0; trailer > 0; )
+            {
+              if (! gz_fill(gz, &strm, input))
+                break;
+              unsigned n = strm.avail_in < (unsigned) trailer
+                ? strm.avail_in : (unsigned) trailer;
+              strm.next_in += n;
+              strm.avail_in -= n;
+              trailer -= n;
+            }
+          if (! gz_fill(gz, &strm, input))
+            break;
+          /* on to the next member */
+          inflateReset2(&strm, 31);
+          raw = false;
+          next_member = true;
+        }
+      /* no header there is trailing garbage, which is fine */
+      else if (ret == Z_DATA_ERROR && ! gz->corrupt
+               && ! (next_member && strm.total_out == 0))
+        {
+          /* it was fine when the index was built */
+          gz->corrupt = true;
+          editor_set_status_msg("Compressed data is corrupt at byte %lld",
+                                (long long) (offset + got));
+          break;
+        }
+      /* Z_BUF_ERROR: out of input at the end of the file */
+      else if (ret != Z_OK)
+        break;
+    }
+
+  inflateEnd(&strm);
+  return got;
+}
+
+/* copy decompressed bytes through the page cache */
+void
+gz_read(struct gz_file *gz, off_t off, char *buf, int len)
+{
+  while (len > 0)
+    {
+      off_t page_off = off - off % GZ_PAGE_SZ;
+      struct gz_page *page = NULL, *victim = &gz->pages[0];
+      for (int i = 0; i < GZ_NUM_PAGES; i++)
+        {
+          if (gz->pages[i].off == page_off)
+            {
+              page = &gz->pages[i];
+              break;
+            }
+          if (gz->pages[i].stamp < victim->stamp)
+            victim = &gz->pages[i];
+        }
+
+      if (page == NULL)
+        {
+          page = victim;
+          if (page->data == NULL
+              && (page->data = malloc(GZ_PAGE_SZ)) == NULL)
+            die(DIE_ERROR_FMT, "malloc");
+          page->off = page_off;
+          page->len = gz_extract(gz, page_off, page->data, GZ_PAGE_SZ);
+        }
+      page->stamp = ++gz->clock;
+
+      int from = off - page_off;
+      int n = page->len - from < len ? page->len - from : len;
+      if (n <= 0)
+        {
+          /* file shrank under us, show the rest as blank */
+          memset(buf, ' ', len);
+          return;
+        }
+      memcpy(buf, page->data + from, n);
+      buf += n;
+      off += n;
+      len -= n;
+    }
+}
+
+void
+gz_open(FILE *fp)
+{
+  struct gz_file *gz = calloc(1, sizeof *gz);
+  if (gz == NULL)
+    die(DIE_ERROR_FMT, "calloc");
+  gz->fp = fp;
+  for (int i = 0; i < GZ_NUM_PAGES; i++)
+    gz->pages[i].off = -1;
+  editor.gz = gz;
+  gz_build_index(gz);
+}
+
+void
+gz_close(struct gz_file *gz)
+{
+  fclose(gz->fp);
+  for (int i = 0; i < gz->num_points; i++)
+    free(gz->points[i].window);
+  free(gz->points);
+  for (int i = 0; i < GZ_NUM_PAGES; i++)
+    free(gz->pages[i].data);
+  free(gz->loaded);
+  free(gz);
+}
+
+/* read through a file description of our own, one shared with another
+   process would have its offset moved under us */
+void
+gz_reopen(struct gz_file *gz, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1 || dup2(fd, fileno(gz->fp)) == -1)
+    die(DIE_ERROR_FMT, "open");
+  close(fd);
+}
+
+/* rows of a compressed file only hold their chars while near the
+   screen, drop the others once we hold too many */
+void
+gz_evict_rows(struct gz_file *gz)
+{
+  int kept = 0;
+  for (int i = 0; i < gz->num_loaded; i++)
+    {
+      int at = gz->loaded[i];
+      struct editor_row *row = &editor.row[at];
+      if (at == editor.cy || (at >= editor.row_offset
+                              && at < editor.row_offset + editor.window_rows))
+        {
+          gz->loaded[kept++] = at;
+          continue;
+        }
+      gz->loaded_bytes -= row->size + row->rsize;
+      free(row->chars);
+      free(row->render);
+      free(row->rcol);
+      free(row->chunk);
+      free(row->hl);
+      row->chars = row->render = NULL;
+      row->rcol = NULL;
+      row->chunk = NULL;
+      row->hl = NULL;
+      row->rsize = 0;
+    }
+  gz->num_loaded = kept;
+}
+
+/* make sure the chars and render of a row are there */
+struct editor_row *
+editor_row_load(int at)
+{
+  struct editor_row *row = &editor.row[at];
+  if (row->chars != NULL)
+    return row;
+
+  struct gz_file *gz = editor.gz;
+  if (gz->loaded_bytes > GZ_ROW_CACHE_SZ)
+    gz_evict_rows(gz);
+
+  row->chars = malloc(row->size + 1);
+  if (row->chars == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  gz_read(gz, row->off, row->chars, row->size);
+  row->chars[row->size] = '\0';
+  editor_update_row(row);
+
+  if (gz->num_loaded == gz->loaded_cap)
+    {
+      gz->loaded_cap = gz->loaded_cap ? gz->loaded_cap * 2 : 256;
+      gz->loaded = realloc(gz->loaded, sizeof *gz->loaded * gz->loaded_cap);
+      if (gz->loaded == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+    }
+  gz->loaded[gz->num_loaded++] = at;
+  gz->loaded_bytes += row->size + row->rsize;
+  return row;
+}
+
+/* ================ soft wrap ================ */
+
+/* with wrapping on, every row takes one or more visual lines. rows are
+ * kept in blocks of a few dozen, with Fenwick trees over the rows and
+ * the visual lines of each block, so the visual line of a row, and the
+ * row at a visual line, are O(log n) plus a block away, and so is
+ * splitting or joining a row. a block grown too big splits in two,
+ * which costs a pass over the blocks every WRAP_BLOCK rows or so. a
+ * count is only recomputed once its row is near the screen, a resize
+ * just makes them all stale. */
+
+#define WRAP_BLOCK 64
+
+/* add d to entry i of a Fenwick tree over n entries */
+void
+fenwick_add(int *tree, int n, int i, int d)
+{
+  for (i++; i <= n; i += i & -i)
+    tree[i] += d;
+}
+
+/* sum of entries [0, i) */
+int
+fenwick_prefix(const int *tree, int i)
+{
+  int sum = 0;
+  for (; i > 0; i -= i & -i)
+    sum += tree[i];
+  return sum;
+}
+
+/* the entry v falls in, counting from 0, with the sum of the ones
+   before it in before */
+int
+fenwick_find(const int *tree, int n, int v, int *before)
+{
+  int at = 0, step = 1;
+  *before = 0;
+  while (step * 2 <= n)
+    step *= 2;
+  for (; step; step /= 2)
+    if (at + step <= n && tree[at + step] <= v)
+      {
+        at += step;
+        v -= tree[at];
+        *before += tree[at];
+      }
+  return at;
+}
+
+/* both trees again from the blocks */
+void
+wrap_fill(void)
+{
+  int n = editor.wrap_blocks;
+  for (int i = 1; i <= n; i++)
+    {
+      editor.wrap_row_tree[i] = editor.wrap_block[i - 1].rows;
+      editor.wrap_tree[i] = editor.wrap_block[i - 1].lines;
+    }
+  for (int i = 1; i <= n; i++)
+    {
+      int up = i + (i & -i);
+      if (up <= n)
+        {
+          editor.wrap_row_tree[up] += editor.wrap_row_tree[i];
+          editor.wrap_tree[up] += editor.wrap_tree[i];
+        }
+    }
+}
+
+/* room for n blocks */
+void
+wrap_reserve(int n)
+{
+  if (n <= editor.wrap_block_cap)
+    return;
+  int cap = editor.wrap_block_cap ? editor.wrap_block_cap : 16;
+  while (cap < n)
+    cap *= 2;
+  editor.wrap_block = realloc(editor.wrap_block,
+                              sizeof *editor.wrap_block * cap);
+  editor.wrap_row_tree = realloc(editor.wrap_row_tree,
+                                 sizeof *editor.wrap_row_tree * (cap + 1));
+  editor.wrap_tree = realloc(editor.wrap_tree,
+                             sizeof *editor.wrap_tree * (cap + 1));
+  if (editor.wrap_block == NULL || editor.wrap_row_tree == NULL
+      || editor.wrap_tree == NULL)
+    die(DIE_ERROR_FMT, "realloc");
+  editor.wrap_block_cap = cap;
+}
+
+/* rebuild from the counts the rows have cached, stale or not */
+void
+wrap_build(void)
+{
+  int n = (editor.num_rows + WRAP_BLOCK - 1) / WRAP_BLOCK;
+  wrap_reserve(n);
+  editor.wrap_blocks = n;
+  for (int b = 0; b < n; b++)
+    {
+      struct wrap_block *block = &editor.wrap_block[b];
+      int first = b * WRAP_BLOCK;
+      block->rows = editor.num_rows - first < WRAP_BLOCK
+        ? editor.num_rows - first : WRAP_BLOCK;
+      block->lines = 0;
+      for (int at = first; at < first + block->rows; at++)
+        block->lines += editor.row[at].wrap_lines;
+    }
+  wrap_fill();
+  editor.wrap_tree_rows = editor.num_rows;
+}
+
+/* rows came or went other than one at a time, or wrapping was never
+   on. built again once, when it's next looked at */
+void
+wrap_sync(void)
+{
+  if (editor.wrap_tree_rows != editor.num_rows)
+    wrap_build();
+}
+
+/* the block row at is in, and its first row */
+int
+wrap_row_block(int at, int *first)
+{
+  return fenwick_find(editor.wrap_row_tree, editor.wrap_blocks, at, first);
+}
+
+/* visual lines of rows [0, at) */
+int
+wrap_prefix(int at)
+{
+  wrap_sync();
+  if (at >= editor.num_rows)
+    return fenwick_prefix(editor.wrap_tree, editor.wrap_blocks);
+  int first;
+  int b = wrap_row_block(at, &first);
+  int sum = fenwick_prefix(editor.wrap_tree, b);
+  for (int i = first; i < at; i++)
+    sum += editor.row[i].wrap_lines;
+  return sum;
+}
+
+void
+wrap_add(int at, int delta)
+{
+  wrap_sync();
+  int first;
+  int b = wrap_row_block(at, &first);
+  editor.wrap_block[b].lines += delta;
+  fenwick_add(editor.wrap_tree, editor.wrap_blocks, b, delta);
+}
+
+/* the row holding visual line v */
+int
+wrap_find(int v)
+{
+  wrap_sync();
+  int before;
+  int b = fenwick_find(editor.wrap_tree, editor.wrap_blocks, v, &before);
+  if (b >= editor.wrap_blocks)
+    return editor.num_rows - 1;
+  int at = fenwick_prefix(editor.wrap_row_tree, b);
+  int last = at + editor.wrap_block[b].rows - 1;
+  for (v -= before; at < last && editor.row[at].wrap_lines <= v; at++)
+    v -= editor.row[at].wrap_lines;
+  return at;
+}
+
+/* row at was just inserted, with a count of 1 */
+void
+wrap_insert_row(int at)
+{
+  if (editor.wrap_tree_rows != editor.num_rows - 1
+      || editor.wrap_blocks == 0)
+    {
+      editor.wrap_tree_rows = -1;
+      return;
+    }
+  int first, b;
+  if (at == editor.num_rows - 1)
+    b = editor.wrap_blocks - 1;
+  else
+    b = wrap_row_block(at, &first);
+  editor.wrap_block[b].rows++;
+  editor.wrap_block[b].lines++;
+  fenwick_add(editor.wrap_row_tree, editor.wrap_blocks, b, 1);
+  fenwick_add(editor.wrap_tree, editor.wrap_blocks, b, 1);
+  editor.wrap_tree_rows++;
+  if (editor.wrap_block[b].rows < 2 * WRAP_BLOCK)
+    return;
+
+  /* split it in two */
+  wrap_reserve(editor.wrap_blocks + 1);
+  struct wrap_block *block = &editor.wrap_block[b];
+  memmove(block + 1, block, sizeof *block * (editor.wrap_blocks - b));
+  editor.wrap_blocks++;
+  first = fenwick_prefix(editor.wrap_row_tree, b);
+  block[0].rows = WRAP_BLOCK;
+  block[0].lines = 0;
+  for (int i = first; i < first + WRAP_BLOCK; i++)
+    block[0].lines += editor.row[i].wrap_lines;
+  block[1].rows -= WRAP_BLOCK;
+  block[1].lines -= block[0].lines;
+  wrap_fill();
+}
+
+/* row at, with lines visual lines, is about to go */
+void
+wrap_delete_row(int at, int lines)
+{
+  if (editor.wrap_tree_rows != editor.num_rows)
+    {
+      editor.wrap_tree_rows = -1;
+      return;
+    }
+  int first;
+  int b = wrap_row_block(at, &first);
+  editor.wrap_block[b].rows--;
+  editor.wrap_block[b].lines -= lines;
+  fenwick_add(editor.wrap_row_tree, editor.wrap_blocks, b, -1);
+  fenwick_add(editor.wrap_tree, editor.wrap_blocks, b, -lines);
+  editor.wrap_tree_rows--;
+  if (editor.wrap_block[b].rows > 0)
+    return;
+
+  /* drop the empty block */
+  struct wrap_block *block = &editor.wrap_block[b];
+  memmove(block, block + 1, sizeof *block * (editor.wrap_blocks - b - 1));
+  editor.wrap_blocks--;
+  wrap_fill();
+}
+
+/* where the visual line after the one starting at column start begins,
+ * -1 if the row ends on this one. a wide char that doesn't fit moves to
+ * the next line whole, so rows that have them are walked, i is the
+ * render byte to carry on from. chunked rows are cut every window
+ * width regardless. */
+int
+wrap_next_start(struct editor_row *row, int *i, int start)
+{
+  int end = start + editor.window_cols;
+  if (row->rcol == NULL)
+    return end < row->rcols ? end : -1;
+
+  while (*i < row->rsize)
+    {
+      int c = row->rcol[*i];
+      int next = *i + 1;
+      while (next < row->rsize && row->rcol[next] == c)
+        next++;
+      if (c > start && row->rcol[next] > end)
+        return c;
+      *i = next;
+    }
+  return -1;
+}
+
+/* the visual line of a row column rx is on, and where that starts */
+int
+wrap_locate(struct editor_row *row, int rx, int *start)
+{
+  int sub = 0, i = 0, next;
+  *start = 0;
+  while ((next = wrap_next_start(row, &i, *start)) != -1 && next <= rx)
+    {
+      *start = next;
+      sub++;
+    }
+  return sub;
+}
+
+/* column the visual line sub of a row starts in */
+int
+wrap_line_start(struct editor_row *row, int sub)
+{
+  int start = 0, i = 0, next;
+  while (sub-- > 0 && (next = wrap_next_start(row, &i, start)) != -1)
+    start = next;
+  return start;
+}
+
+/* bring the count of a row up to date with the window width,
+   returns it */
+int
+wrap_refresh(int at)
+{
+  struct editor_row *row = &editor.row[at];
+  if (row->wrap_width == editor.window_cols)
+    return row->wrap_lines;
+
+  row = editor_row_load(at);
+  int lines = 1;
+  if (row->rcol == NULL)
+    lines = (row->rcols + editor.window_cols - 1) / editor.window_cols;
+  else
+    for (int start = 0, i = 0;
+         (start = wrap_next_start(row, &i, start)) != -1; )
+      lines++;
+  if (lines == 0)
+    lines = 1;
+  wrap_add(at, lines - row->wrap_lines);
+  row->wrap_lines = lines;
+  row->wrap_width = editor.window_cols;
+  return lines;
+}
+
+/* visual line within its row that column rx falls on */
+int
+wrap_sub(int at, int rx)
+{
+  if (at >= editor.num_rows)
+    return 0;
+  wrap_refresh(at);
+  int start;
+  return wrap_locate(editor_row_load(at), rx, &start);
+}
+
+/* visual line of the cursor, and of the top of the screen */
+int
+wrap_cursor_line(void)
+{
+  return wrap_prefix(editor.cy) + wrap_sub(editor.cy, editor.rx);
+}
+
+int
+wrap_top_line(void)
+{
+  return wrap_prefix(editor.row_offset) + editor.wrap_offset;
+}
+
+/* put the top of the screen at visual line v */
+void
+wrap_set_top(int v)
+{
+  if (v < 0)
+    v = 0;
+  if (editor.num_rows == 0)
+    {
+      editor.row_offset = editor.wrap_offset = 0;
+      return;
+    }
+  editor.row_offset = wrap_find(v);
+  editor.wrap_offset = v - wrap_prefix(editor.row_offset);
+  int lines = wrap_refresh(editor.row_offset);
+  if (editor.wrap_offset >= lines)
+    editor.wrap_offset = lines - 1;
+}
+
+/* line of the screen the cursor is on, negative above it and
+   window_rows or more below. the rows in between are about to be drawn,
+   their counts are brought up to date first, but no more of them than
+   fit on the screen */
+int
+wrap_cursor_screen_line(void)
+{
+  int sub = wrap_sub(editor.cy, editor.rx);
+  if (editor.cy < editor.row_offset)
+    return -1;
+  int line = -editor.wrap_offset;
+  for (int at = editor.row_offset;
+       at < editor.cy && line < editor.window_rows; at++)
+    line += wrap_refresh(at);
+  return line + sub;
+}
+
+void
+wrap_scroll(void)
+{
+  wrap_sync();
+  if (editor.row_offset < editor.num_rows
+      && editor.wrap_offset >= wrap_refresh(editor.row_offset))
+    editor.wrap_offset = 0;
+
+  int line = wrap_cursor_screen_line();
+  int sub = wrap_sub(editor.cy, editor.rx);
+  if (line < 0)
+    {
+      editor.row_offset = editor.cy;
+      editor.wrap_offset = sub;
+      return;
+    }
+  if (line < editor.window_rows)
+    return;
+
+  /* cursor on the bottom line, go up from it counting the lines of the
+     rows above until the screen is full */
+  int above = editor.window_rows - 1;
+  editor.row_offset = editor.cy;
+  if (sub >= above)
+    {
+      editor.wrap_offset = sub - above;
+      return;
+    }
+  above -= sub;
+  editor.wrap_offset = 0;
+  while (above > 0 && editor.row_offset > 0)
+    {
+      int lines = wrap_refresh(--editor.row_offset);
+      if (lines >= above)
+        {
+          editor.wrap_offset = lines - above;
+          return;
+        }
+      above -= lines;
+    }
+}
+
+/* ================ syntax highlighting ================ */
+
+/* every row keeps the lexer state it ends in, correct for the rows
+ * before hl_valid_to and as it was before the latest edits up to
+ * hl_known_to. an edit only marks rows stale; the next redraw lexes
+ * them again, along with the rows after them until one ends in the
+ * same state as before. colors are only worked out for rows that get
+ * drawn, and a redraw lexes at most HL_SYNC_ROWS rows to get there,
+ * so rows further on are colored on a guess until later redraws
+ * catch up. */
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+/* rows one redraw may lex to find out where it starts */
+#define HL_SYNC_ROWS 20000
+/* rows above a guessed row lexed to make the guess */
+#define HL_GUESS_ROWS 200
+
+/* what a render byte is */
+enum editor_highlight
+{
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+};
+
+/* what a row ends in */
+enum editor_hl_state
+{
+  HL_STATE_NORMAL = 0,
+  HL_STATE_COMMENT,
+};
+
+struct editor_syntax
+{
+  /* for the status bar */
+  const char *filetype;
+  /* extensions start with a '.', anything else matches the name */
+  const char **filematch;
+  /* type 2 keywords end in a '|' */
+  const char **keywords;
+  const char *singleline_comment_start;
+  const char *multiline_comment_start;
+  const char *multiline_comment_end;
+  int flags;
+};
+
+const char *c_hl_extensions[] = { ".c", ".h", ".cc", ".cpp", ".cxx", ".hpp",
+                                  NULL };
+const char *c_hl_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "do",
+  "goto", "default", "sizeof", "const", "volatile", "extern", "inline",
+  "#include", "#define", "#ifdef", "#ifndef", "#endif", "#else", "#if",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "bool|", "short|", "size_t|", "ssize_t|", "off_t|", NULL
+};
+
+const char *conf_hl_extensions[] = { ".conf", ".cfg", ".ini", ".toml",
+                                     ".yaml", ".yml", ".sh", ".properties",
+                                     "Makefile", NULL };
+const char *conf_hl_keywords[] = {
+  "true|", "false|", "yes|", "no|", "on|", "off|", "null|", NULL
+};
+
+struct editor_syntax hldb[] = {
+  {
+    "C",
+    c_hl_extensions,
+    c_hl_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+  {
+    "Conf",
+    conf_hl_extensions,
+    conf_hl_keywords,
+    "#", NULL, NULL,
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(hldb) / sizeof(hldb[0]))
+
+bool
+is_separator(int c)
+{
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:", c) != NULL;
+}
+
+/* lex text starting in state, filling hl if there is one,
+   returns the state at the end */
+int
+editor_hl_scan(const char *text, int len, int state, unsigned char *hl)
+{
+  struct editor_syntax *syntax = editor.syntax;
+  const char *scs = syntax->singleline_comment_start;
+  const char *mcs = syntax->multiline_comment_start;
+  const char *mce = syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  bool prev_sep = true;
+  int prev_hl = HL_NORMAL;
+  int in_string = 0;
+  bool in_comment = state == HL_STATE_COMMENT;
+
+#define HL_MARK(at, n, type) do {                        \
+    if (hl)                                              \
+      memset(&hl[at], type, n);                          \
+    prev_hl = type;                                      \
+  } while (0)
+
+  int i = 0;
+  while (i < len)
+    {
+      unsigned char c = text[i];
+
+      if (scs_len && ! in_string && ! in_comment
+          && strncmp(&text[i], scs, scs_len) == 0)
+        {
+          HL_MARK(i, len - i, HL_COMMENT);
+          break;
+        }
+
+      if (mcs_len && mce_len && ! in_string)
+        {
+          if (in_comment)
+            {
+              if (strncmp(&text[i], mce, mce_len) == 0)
+                {
+                  HL_MARK(i, mce_len, HL_MLCOMMENT);
+                  i += mce_len;
+                  in_comment = false;
+                  prev_sep = true;
+                }
+              else
+                {
+                  HL_MARK(i, 1, HL_MLCOMMENT);
+                  i++;
+                }
+              continue;
+            }
+          else if (strncmp(&text[i], mcs, mcs_len) == 0)
+            {
+              HL_MARK(i, mcs_len, HL_MLCOMMENT);
+              i += mcs_len;
+              in_comment = true;
+              continue;
+            }
+        }
+
+      if (syntax->flags & HL_HIGHLIGHT_STRINGS)
+        {
+          if (in_string)
+            {
+              HL_MARK(i, 1, HL_STRING);
+              if (c == '\\' && i + 1 < len)
+                {
+                  HL_MARK(i + 1, 1, HL_STRING);
+                  i += 2;
+                  continue;
+                }
+              if (c == in_string)
+                in_string = 0;
+              i++;
+              prev_sep = true;
+              continue;
+            }
+          else if (c == '"' || c == '\'')
+            {
+              in_string = c;
+              HL_MARK(i, 1, HL_STRING);
+              i++;
+              continue;
+            }
+        }
+
+      /* neither numbers nor keywords change the state */
+      if (hl == NULL)
+        {
+          i++;
+          continue;
+        }
+
+      if (syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER))
+            || (c == '.' && prev_hl == HL_NUMBER))
+          {
+            HL_MARK(i, 1, HL_NUMBER);
+            i++;
+            prev_sep = false;
+            continue;
+          }
+
+      if (prev_sep)
+        {
+          int j;
+          for (j = 0; syntax->keywords[j]; j++)
+            {
+              int klen = strlen(syntax->keywords[j]);
+              bool kw2 = syntax->keywords[j][klen - 1] == '|';
+              if (kw2)
+                klen--;
+              if (i + klen <= len
+                  && strncmp(&text[i], syntax->keywords[j], klen) == 0
+                  && (i + klen == len
+                      || is_separator((unsigned char) text[i + klen])))
+                {
+                  HL_MARK(i, klen, kw2 ? HL_KEYWORD2 : HL_KEYWORD1);
+                  i += klen;
+                  break;
+                }
+            }
+          if (syntax->keywords[j] != NULL)
+            {
+              prev_sep = false;
+              continue;
+            }
+        }
+
+      HL_MARK(i, 1, HL_NORMAL);
+      prev_sep = is_separator(c);
+      i++;
+    }
+
+#undef HL_MARK
+
+  return in_comment ? HL_STATE_COMMENT : HL_STATE_NORMAL;
+}
+
+/* chunked rows have no render, they are only lexed for their state */
+int
+editor_hl_scan_row(struct editor_row *row, int state, unsigned char *hl)
+{
+  if (row->render)
+    return editor_hl_scan(row->render, row->rsize, state, hl);
+  return editor_hl_scan(row->chars, row->size, state, NULL);
+}
+
+int
+editor_hl_state_before(int at)
+{
+  return at == 0 ? HL_STATE_NORMAL : editor.row[at - 1].hl_state;
+}
+
+/* forget how a row was lexed */
+void
+editor_hl_stale(int at)
+{
+  struct editor_row *row = &editor.row[at];
+  free(row->hl);
+  row->hl = NULL;
+  row->hl_stale = true;
+}
+
+/* lex a row from where the row before ends, coloring it if asked.
+   the row after is stale if this one now ends differently */
+void
+editor_hl_lex(int at, bool color)
+{
+  struct editor_row *row = editor_row_load(at);
+  int old = row->hl_state;
+  free(row->hl);
+  row->hl = NULL;
+  if (color && row->render)
+    {
+      row->hl = malloc(row->rsize + 1);
+      if (row->hl == NULL)
+        die(DIE_ERROR_FMT, "malloc");
+    }
+  row->hl_state = editor_hl_scan_row(row, editor_hl_state_before(at),
+                                     row->hl);
+  row->hl_stale = false;
+  if ((at >= editor.hl_known_to || row->hl_state != old)
+      && at + 1 < editor.num_rows)
+    editor_hl_stale(at + 1);
+
+  if (editor.hl_valid_to == at)
+    editor.hl_valid_to++;
+  if (editor.hl_known_to < editor.hl_valid_to)
+    editor.hl_known_to = editor.hl_valid_to;
+}
+
+/* get the end states of rows [0, at) right, without coloring them.
+   false if this redraw ran out of rows to lex first */
+bool
+editor_hl_sync(int at)
+{
+  while (editor.hl_valid_to < at)
+    {
+      int r = editor.hl_valid_to;
+      /* starts where it did and wasn't touched, still ends the same */
+      if (r < editor.hl_known_to && ! editor.row[r].hl_stale)
+        {
+          editor.hl_valid_to++;
+          continue;
+        }
+      if (editor.hl_budget == 0)
+        return false;
+      editor.hl_budget--;
+      editor_hl_lex(r, false);
+    }
+  return true;
+}
+
+/* color a row the sync didn't get to, from the state the row above
+   last ended in, or if that was never worked out, from lexing a few
+   rows above it as if they started outside a comment */
+void
+editor_hl_guess(int at)
+{
+  struct editor_row *row = editor_row_load(at);
+  if (row->hl || row->render == NULL)
+    return;
+
+  int state = HL_STATE_NORMAL;
+  if (at > 0 && (at - 1 < editor.hl_known_to || editor.row[at - 1].hl))
+    state = editor.row[at - 1].hl_state;
+  else
+    {
+      int from = at - HL_GUESS_ROWS;
+      if (from <= editor.hl_known_to)
+        {
+          from = editor.hl_known_to;
+          state = editor_hl_state_before(from);
+        }
+      /* nothing past hl_known_to depends on these, so keep them */
+      for (int r = from; r < at; r++)
+        {
+          struct editor_row *prev = editor_row_load(r);
+          prev->hl_state = state = editor_hl_scan_row(prev, state, NULL);
+          prev->hl_stale = true;
+        }
+      row = editor_row_load(at);
+    }
+
+  row->hl = malloc(row->rsize + 1);
+  if (row->hl == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  state = editor_hl_scan(row->render, row->rsize, state, row->hl);
+  if (at >= editor.hl_known_to)
+    row->hl_state = state;
+  row->hl_stale = true;
+}
+
+/* load a row for drawing, colored if we know its language */
+struct editor_row *
+editor_hl_row(int at)
+{
+  if (editor.syntax == NULL)
+    return editor_row_load(at);
+
+  if (! editor_hl_sync(at))
+    editor_hl_guess(at);
+  else if (editor.row[at].hl == NULL || editor.row[at].hl_stale)
+    editor_hl_lex(at, true);
+  return editor_row_load(at);
+}
+
+/* rows [at, at + n) changed, the next redraw lexes them again */
+void
+editor_hl_invalidate(int at, int n)
+{
+  if (editor.syntax == NULL)
+    return;
+
+  for (int i = at; i < at + n && i < editor.num_rows; i++)
+    editor_hl_stale(i);
+  if (at < editor.hl_valid_to)
+    editor.hl_valid_to = at;
+}
+
+int
+editor_hl_to_color(int hl)
+{
+  switch (hl)
+    {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+      return 36;
+    case HL_KEYWORD1:
+      return 33;
+    case HL_KEYWORD2:
+      return 32;
+    case HL_STRING:
+      return 35;
+    case HL_NUMBER:
+      return 31;
+    default:
+      return 39;
+    }
+}
+
+void
+editor_select_syntax(void)
+{
+  editor.syntax = NULL;
+  if (editor.filename == NULL)
+    return;
+
+  const char *base = strrchr(editor.filename, '/');
+  base = base ? base + 1 : editor.filename;
+  /* foo.conf.gz is still a conf file */
+  size_t len = strlen(base);
+  if (len > 3 && strcmp(base + len - 3, ".gz") == 0)
+    len -= 3;
+
+  for (size_t j = 0; j < HLDB_ENTRIES; j++)
+    for (int i = 0; hldb[j].filematch[i]; i++)
+      {
+        const char *match = hldb[j].filematch[i];
+        size_t mlen = strlen(match);
+        bool is_ext = match[0] == '.';
+        if ((is_ext && len > mlen
+             && strncmp(base + len - mlen, match, mlen) == 0)
+            || (! is_ext && len == mlen && strncmp(base, match, mlen) == 0))
+          {
+            editor.syntax = &hldb[j];
+            return;
+          }
+      }
+}
+
+/* ================ recovery journal ================ */
+
+/* every edit is also appended to a journal next to the file, so that a
+ * crash loses at most the last moment of work. the editor only copies
+ * the record into a ring and wakes the flusher thread, which sleeps
+ * until then, writes whatever piled up in one go and syncs once for all
+ * of it. the journal starts with the size, mtime and inode of the file
+ * it applies to, and is replayed when that same file is opened again.
+ * it goes away on save and on exit. */
+
+#define JOURNAL_RING_SZ (1024 * 1024)
+/* an edit wakes the flusher itself only past this much, otherwise the
+   next redraw does */
+#define JOURNAL_HIGH_WATER (JOURNAL_RING_SZ / 4)
+#define JOURNAL_MAGIC "LEJRNL2\n"
+
+struct journal_header
+{
+  char magic[8];
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t dev;
+  uint64_t ino;
+};
+
+enum journal_type
+{
+  JOURNAL_INSERT = 'I',
+  JOURNAL_DELETE = 'D',
+};
+
+/* an insert is followed by its len bytes of text */
+struct journal_rec
+{
+  uint32_t type;
+  int32_t y;
+  int32_t x;
+  uint32_t unused;
+  uint64_t len;
+};
+
+struct journal
+{
+  char *path;
+  /* -1 until the first edit */
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /* the flusher waits on wake, the editor on drained when the ring
+     is full */
+  pthread_cond_t wake;
+  pthread_cond_t drained;
+  /* set by the flusher before its last look at head, it's only woken
+     then */
+  _Atomic bool sleeping;
+  bool stop;
+  /* only the editor moves head, only the flusher moves tail */
+  char *ring;
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  /* errno of the first write that failed */
+  _Atomic int error;
+  /* edits being replayed aren't journaled again */
+  bool replaying;
+} journal = { .fd = -1 };
+
+/* what the file the edits apply to looked like */
+void
+journal_header(struct journal_header *h)
+{
+  memset(h, 0, sizeof *h);
+  memcpy(h->magic, JOURNAL_MAGIC, sizeof h->magic);
+  h->size = editor.file_size;
+  h->mtime_sec = editor.file_mtime.tv_sec;
+  h->mtime_nsec = editor.file_mtime.tv_nsec;
+  h->dev = editor.file_dev;
+  h->ino = editor.file_ino;
+}
+
+/* .name.le-journal next to name */
+char *
+journal_path(const char *filename)
+{
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  size_t dir_len = base - filename;
+  char *path = malloc(dir_len + strlen(base) + sizeof("..le-journal"));
+  if (path == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  sprintf(path, "%.*s.%s.le-journal", (int) dir_len, filename, base);
+  return path;
+}
+
+void
+journal_write(const char *s, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write(journal.fd, s, len);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        {
+          int none = 0;
+          atomic_compare_exchange_strong(&journal.error, &none, errno);
+          return;
+        }
+      s += n;
+      len -= n;
+    }
+}
+
+void *
+journal_flusher(void *arg [[maybe_unused]])
+{
+  pthread_mutex_lock(&journal.lock);
+  while (1)
+    {
+      size_t tail = atomic_load_explicit(&journal.tail, memory_order_relaxed);
+      size_t head = atomic_load_explicit(&journal.head, memory_order_acquire);
+      if (head == tail)
+        {
+          if (journal.stop)
+            break;
+          /* either the editor sees this, or we see its edit */
+          atomic_store_explicit(&journal.sleeping, true,
+                                memory_order_relaxed);
+          atomic_thread_fence(memory_order_seq_cst);
+          if (atomic_load_explicit(&journal.head, memory_order_relaxed)
+              == tail)
+            pthread_cond_wait(&journal.wake, &journal.lock);
+          atomic_store_explicit(&journal.sleeping, false,
+                                memory_order_relaxed);
+          continue;
+        }
+      pthread_mutex_unlock(&journal.lock);
+
+      /* all of it in one write, one sync, two if it wraps around */
+      size_t from = tail % JOURNAL_RING_SZ;
+      size_t len = head - tail;
+      size_t first = JOURNAL_RING_SZ - from < len
+        ? JOURNAL_RING_SZ - from : len;
+      journal_write(journal.ring + from, first);
+      journal_write(journal.ring, len - first);
+#ifdef __linux__
+      fdatasync(journal.fd);
+#else
+      fsync(journal.fd);
+#endif
+
+      pthread_mutex_lock(&journal.lock);
+      atomic_store_explicit(&journal.tail, head, memory_order_release);
+      pthread_cond_broadcast(&journal.drained);
+    }
+  pthread_mutex_unlock(&journal.lock);
+  return NULL;
+}
+
+/* start journaling edits to the file, false if it can't be */
+bool
+journal_start(void)
+{
+  if (journal.fd != -1)
+    return true;
+  if (journal.error)
+    return false;
+
+  if (journal.path == NULL)
+    journal.path = journal_path(editor.filename);
+  journal.fd = open(journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                    0600);
+  if (journal.fd == -1)
+    {
+      journal.error = errno;
+      return false;
+    }
+
+  struct journal_header h;
+  journal_header(&h);
+  journal_write((const char *) &h, sizeof h);
+  return true;
+}
+
+/* the ring and the flusher, once there is something to flush */
+void
+journal_start_flusher(void)
+{
+  if (journal.ring)
+    return;
+  journal.ring = malloc(JOURNAL_RING_SZ);
+  if (journal.ring == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  journal.stop = false;
+  journal.sleeping = false;
+  pthread_mutex_init(&journal.lock, NULL);
+  pthread_cond_init(&journal.wake, NULL);
+  pthread_cond_init(&journal.drained, NULL);
+  if ((errno = pthread_create(&journal.thread, NULL, journal_flusher, NULL)))
+    die(DIE_ERROR_FMT, "pthread_create");
+}
+
+/* have the flusher write out what's in the ring, if it's waiting */
+void
+journal_wake(void)
+{
+  if (journal.ring == NULL)
+    return;
+  /* a flusher that's awake looks at head again before it sleeps */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&journal.sleeping, memory_order_relaxed))
+    {
+      pthread_mutex_lock(&journal.lock);
+      pthread_cond_signal(&journal.wake);
+      pthread_mutex_unlock(&journal.lock);
+    }
+}
+
+/* copy into the ring, waiting for the flusher only if it's full */
+void
+journal_put(const void *p, size_t len)
+{
+  const char *s = p;
+  while (len > 0)
+    {
+      size_t head = atomic_load_explicit(&journal.head, memory_order_relaxed);
+      size_t tail = atomic_load_explicit(&journal.tail, memory_order_acquire);
+      size_t room = JOURNAL_RING_SZ - (head - tail);
+      if (room == 0)
+        {
+          pthread_mutex_lock(&journal.lock);
+          pthread_cond_signal(&journal.wake);
+          while (atomic_load(&journal.tail) == tail)
+            pthread_cond_wait(&journal.drained, &journal.lock);
+          pthread_mutex_unlock(&journal.lock);
+          continue;
+        }
+
+      size_t at = head % JOURNAL_RING_SZ;
+      size_t n = len < room ? len : room;
+      if (n > JOURNAL_RING_SZ - at)
+        n = JOURNAL_RING_SZ - at;
+      memcpy(journal.ring + at, s, n);
+      atomic_store_explicit(&journal.head, head + n, memory_order_release);
+      s += n;
+      len -= n;
+    }
+}
+
+void
+journal_record(enum journal_type type, int y, int x, const char *s,
+               size_t len)
+{
+  if (journal.replaying || editor.filename == NULL)
+    return;
+  if (! journal_start() || journal.error)
+    {
+      editor_set_status_msg("Can't journal edits: %s",
+                            strerror(journal.error));
+      if (journal.fd == -1)
+        return;
+    }
+  journal_start_flusher();
+  struct journal_rec rec = { type, y, x, 0, len };
+  journal_put(&rec, sizeof rec);
+  if (type == JOURNAL_INSERT)
+    journal_put(s, len);
+
+  if (atomic_load_explicit(&journal.head, memory_order_relaxed)
+      - atomic_load_explicit(&journal.tail, memory_order_relaxed)
+      >= JOURNAL_HIGH_WATER)
+    journal_wake();
+}
+
+/* flush what's left, and throw the journal away if it isn't needed */
+void
+journal_stop(bool remove)
+{
+  if (journal.ring)
+    {
+      pthread_mutex_lock(&journal.lock);
+      journal.stop = true;
+      pthread_cond_signal(&journal.wake);
+      pthread_mutex_unlock(&journal.lock);
+      pthread_join(journal.thread, NULL);
+      pthread_mutex_destroy(&journal.lock);
+      pthread_cond_destroy(&journal.wake);
+      pthread_cond_destroy(&journal.drained);
+      free(journal.ring);
+      journal.ring = NULL;
+      journal.head = journal.tail = 0;
+    }
+  if (journal.fd != -1)
+    {
+      close(journal.fd);
+      journal.fd = -1;
+    }
+  if (remove && journal.path)
+    unlink(journal.path);
+  free(journal.path);
+  journal.path = NULL;
+  journal.error = 0;
+}
+
+/* ================ editing ================ */
+
+/* all changes to the text go through editor_insert_text and
+ * editor_delete_text, a '\n' in the text being the boundary between two
+ * rows. they keep the render, wrap counts and lexer states of the rows
+ * they touch in order. an empty last row without a line terminator is
+ * the same as the end of the buffer, and is never kept; the '\n' at the
+ * end of the buffer, if there is one, is the eol of the last row. */
+
+void
+editor_row_changed(int at)
+{
+  struct editor_row *row = &editor.row[at];
+  row->dirty = true;
+  editor.dirty = true;
+  editor.edits++;
+  editor_update_row(row);
+  /* counted again once it is near the screen */
+  row->wrap_width = 0;
+}
+
+struct editor_row *
+editor_insert_row(int at, const char *s, size_t len)
+{
+  editor_new_row();
+  struct editor_row *row = &editor.row[at];
+  memmove(row + 1, row, sizeof *row * (editor.num_rows - 1 - at));
+  memset(row, 0, sizeof *row);
+  row->wrap_lines = 1;
+  row->size = len;
+  row->chars = malloc(len + 1);
+  if (row->chars == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  /* until it is lexed, the rows after it expect what they used to */
+  row->hl_state = editor_hl_state_before(at);
+  row->hl_stale = true;
+  if (at < editor.hl_valid_to)
+    editor.hl_valid_to = at;
+  if (at < editor.hl_known_to)
+    editor.hl_known_to++;
+  /* the row before needs a line terminator now */
+  if (at > 0 && editor.row[at - 1].eol == 0)
+    editor.row[at - 1].dirty = true;
+
+  editor_row_changed(at);
+  wrap_insert_row(at);
+  return row;
+}
+
+void
+editor_delete_row(int at)
+{
+  struct editor_row *row = &editor.row[at];
+  wrap_delete_row(at, row->wrap_lines);
+  free(row->chars);
+  free(row->render);
+  free(row->rcol);
+  free(row->chunk);
+  free(row->hl);
+  memmove(row, row + 1, sizeof *row * (editor.num_rows - 1 - at));
+  editor.num_rows--;
+  /* the row after starts where this one did, it has to be lexed to
+     tell if it still ends the same */
+  if (at < editor.num_rows)
+    editor.row[at].hl_stale = true;
+  if (at < editor.hl_valid_to)
+    editor.hl_valid_to = at;
+  if (at < editor.hl_known_to)
+    editor.hl_known_to--;
+  editor.dirty = true;
+}
+
+/* the empty last row a split at the very end leaves behind */
+void
+editor_trim_last_row(void)
+{
+  int last = editor.num_rows - 1;
+  if (last >= 0 && editor.row[last].size == 0 && editor.row[last].eol == 0)
+    editor_delete_row(last);
+}
+
+void
+editor_row_insert(int at, int pos, const char *s, size_t len)
+{
+  struct editor_row *row = &editor.row[at];
+  char *chars = realloc(row->chars, row->size + len + 1);
+  if (chars == NULL)
+    die(DIE_ERROR_FMT, "realloc");
+  row->chars = chars;
+  memmove(&chars[pos + len], &chars[pos], row->size - pos + 1);
+  memcpy(&chars[pos], s, len);
+  row->size += len;
+  editor_row_changed(at);
+}
+
+/* the rest of the row from pos on moves to a new row after it */
+void
+editor_split_row(int at, int pos)
+{
+  struct editor_row *row = &editor.row[at];
+  int eol = row->eol;
+  editor_insert_row(at + 1, &row->chars[pos], row->size - pos);
+  editor.row[at + 1].eol = eol;
+
+  row = &editor.row[at];
+  row->size = pos;
+  row->chars[pos] = '\0';
+  row->eol = eol ? eol : editor.eol;
+  editor_row_changed(at);
+}
+
+/* whether (y, x) is in the buffer. the row past the last one is only
+   there, for inserting, if the last one ends in a '\n' */
+bool
+editor_text_pos_ok(int y, int x, bool end)
+{
+  if (y < 0 || x < 0 || y > editor.num_rows)
+    return false;
+  if (y == editor.num_rows)
+    return end && x == 0 && (y == 0 || editor.row[y - 1].eol > 0);
+  return x <= editor.row[y].size;
+}
+
+/* insert s at (*y, *x), leaving them just past it. false, and nothing
+   done, if that isn't in the buffer */
+bool
+editor_insert_text(int *y, int *x, const char *s, size_t len)
+{
+  if (! editor_text_pos_ok(*y, *x, true))
+    return false;
+  journal_record(JOURNAL_INSERT, *y, *x, s, len);
+  int first = *y;
+  if (*y == editor.num_rows)
+    editor_insert_row(*y, "", 0);
+
+  while (1)
+    {
+      const char *nl = memchr(s, '\n', len);
+      size_t n = nl ? (size_t) (nl - s) : len;
+      if (n > 0)
+        editor_row_insert(*y, *x, s, n);
+      *x += n;
+      if (nl == NULL)
+        break;
+      editor_split_row(*y, *x);
+      (*y)++;
+      *x = 0;
+      s += n + 1;
+      len -= n + 1;
+    }
+
+  editor_hl_invalidate(first, *y - first + 1);
+  editor_trim_last_row();
+  return true;
+}
+
+/* delete len bytes from (y, x) on, copying them to out if it isn't
+   NULL. the end of a row counts as one byte, the '\n'. false, and
+   nothing done, if (y, x) isn't in the buffer */
+bool
+editor_delete_text(int y, int x, size_t len, char *out)
+{
+  if (! editor_text_pos_ok(y, x, false))
+    return false;
+  journal_record(JOURNAL_DELETE, y, x, NULL, len);
+  struct editor_row *row = &editor.row[y];
+  while (1)
+    {
+      size_t n = row->size - x;
+      if (n > len)
+        n = len;
+      if (out)
+        {
+          memcpy(out, &row->chars[x], n);
+          out += n;
+        }
+      memmove(&row->chars[x], &row->chars[x + n], row->size - x - n + 1);
+      row->size -= n;
+      len -= n;
+      if (len == 0)
+        break;
+      if (y + 1 >= editor.num_rows)
+        {
+          /* the '\n' the buffer ends with */
+          if (row->eol > 0)
+            {
+              row->eol = 0;
+              if (out)
+                *out++ = '\n';
+            }
+          break;
+        }
+
+      /* join the next row on */
+      struct editor_row *next = &editor.row[y + 1];
+      char *chars = realloc(row->chars, row->size + next->size + 1);
+      if (chars == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+      memcpy(&chars[row->size], next->chars, next->size + 1);
+      row->chars = chars;
+      row->size += next->size;
+      row->eol = next->eol;
+      if (out)
+        *out++ = '\n';
+      len--;
+      editor_delete_row(y + 1);
+      row = &editor.row[y];
+    }
+
+  editor_row_changed(y);
+  editor_hl_invalidate(y, 1);
+  editor_trim_last_row();
+  return true;
+}
+
+/* cut a row off at pos without copying what goes, which is returned
+   as the old chars buffer, starting at pos */
+char *
+editor_row_take_tail(int at, int pos)
+{
+  struct editor_row *row = &editor.row[at];
+  journal_record(JOURNAL_DELETE, at, pos, NULL, row->size - pos);
+  char *old = row->chars;
+  row->chars = malloc(pos + 1);
+  if (row->chars == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  memcpy(row->chars, old, pos);
+  row->chars[pos] = '\0';
+  row->size = pos;
+  editor_row_changed(at);
+  editor_hl_invalidate(at, 1);
+  return old;
+}
+
+/* ================ undo ================ */
+
+/* the undo log is an arena of insert and delete records, only ever
+ * appended to. typing or deleting one char after another grows the
+ * last record instead of adding one, up to UNDO_RUN_MAX bytes. a big
+ * kill doesn't copy the text either, its record takes over the old
+ * chars buffer of the row. undo and redo walk back and forth over the
+ * records, an edit after undoing drops the ones that could be redone.
+ * past UNDO_LIMIT bytes, refs included, the oldest records go. */
+
+#ifndef UNDO_LIMIT
+#define UNDO_LIMIT (8 * 1024 * 1024)
+#endif
+/* kills this long keep the row's buffer instead of a copy */
+#define UNDO_REF_MIN 4096
+#define UNDO_RUN_MAX 20
+
+enum undo_type
+{
+  UNDO_INSERT,
+  UNDO_DELETE,
+};
+
+struct undo_rec
+{
+  /* where the text starts */
+  int y, x;
+  size_t len;
+  /* the text is at ref + ref_off for a big kill, otherwise it follows
+     the record in the arena */
+  char *ref;
+  size_t ref_off;
+  /* how much the ref holds on to */
+  size_t ref_sz;
+  /* room for the text after the record */
+  size_t room;
+  enum undo_type type;
+};
+
+struct undo_log
+{
+  char *arena;
+  size_t used;
+  size_t cap;
+  /* offset of each record within the arena */
+  size_t *rec;
+  int num_recs;
+  int rec_cap;
+  /* records before pos are done, the ones after can be redone */
+  int pos;
+  /* arena plus refs */
+  size_t bytes;
+  /* keystrokes so far, and the one that last grew a run */
+  unsigned long tick;
+  unsigned long run_tick;
+} undo_log;
+
+#define UNDO_ALIGN(n) (((n) + _Alignof(struct undo_rec) - 1)       \
+                       & ~(_Alignof(struct undo_rec) - 1))
+
+struct undo_rec *
+undo_rec_at(int i)
+{
+  return (struct undo_rec *) (undo_log.arena + undo_log.rec[i]);
+}
+
+char *
+undo_text(struct undo_rec *r)
+{
+  return r->ref ? r->ref + r->ref_off : (char *) (r + 1);
+}
+
+/* a new keystroke, anything but more of the same ends a run */
+void
+undo_tick(void)
+{
+  undo_log.tick++;
+}
+
+/* drop records [from, to), which are at one end of the log */
+void
+undo_drop(int from, int to)
+{
+  for (int i = from; i < to; i++)
+    {
+      struct undo_rec *r = undo_rec_at(i);
+      if (r->ref)
+        {
+          free(r->ref);
+          undo_log.bytes -= r->ref_sz;
+        }
+    }
+
+  if (to == undo_log.num_recs)
+    {
+      size_t end = from < to ? undo_log.rec[from] : undo_log.used;
+      undo_log.bytes -= undo_log.used - end;
+      undo_log.used = end;
+      undo_log.num_recs = from;
+      if (undo_log.pos > from)
+        undo_log.pos = from;
+      return;
+    }
+
+  /* the oldest, move what's left down */
+  size_t start = undo_log.rec[to];
+  memmove(undo_log.arena, undo_log.arena + start, undo_log.used - start);
+  undo_log.used -= start;
+  undo_log.bytes -= start;
+  for (int i = to; i < undo_log.num_recs; i++)
+    undo_log.rec[i - to] = undo_log.rec[i] - start;
+  undo_log.num_recs -= to;
+  undo_log.pos -= to;
+}
+
+/* a new record with room for len bytes of text, the log grows no
+   further than UNDO_LIMIT past this one */
+struct undo_rec *
+undo_new(enum undo_type type, int y, int x, size_t len, size_t room)
+{
+  /* whatever could be redone is gone once something else changes */
+  undo_drop(undo_log.pos, undo_log.num_recs);
+
+  /* dropping a little past the limit, so it isn't done every key */
+  if (undo_log.bytes > UNDO_LIMIT)
+    {
+      int n = 0;
+      size_t freed = 0;
+      while (n < undo_log.num_recs
+             && undo_log.bytes - freed > UNDO_LIMIT - UNDO_LIMIT / 8)
+        {
+          struct undo_rec *r = undo_rec_at(n);
+          size_t next = n + 1 < undo_log.num_recs
+            ? undo_log.rec[n + 1] : undo_log.used;
+          freed += next - undo_log.rec[n] + (r->ref ? r->ref_sz : 0);
+          n++;
+        }
+      undo_drop(0, n);
+    }
+
+  size_t sz = UNDO_ALIGN(sizeof(struct undo_rec) + room);
+  if (undo_log.used + sz > undo_log.cap)
+    {
+      size_t cap = undo_log.cap ? undo_log.cap : 4096;
+      while (cap < undo_log.used + sz)
+        cap *= 2;
+      char *arena = realloc(undo_log.arena, cap);
+      if (arena == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+      undo_log.arena = arena;
+      undo_log.cap = cap;
+    }
+  if (undo_log.num_recs == undo_log.rec_cap)
+    {
+      int cap = undo_log.rec_cap ? undo_log.rec_cap * 2 : 256;
+      size_t *rec = realloc(undo_log.rec, sizeof *rec * cap);
+      if (rec == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+      undo_log.rec = rec;
+      undo_log.rec_cap = cap;
+    }
+
+  undo_log.rec[undo_log.num_recs++] = undo_log.used;
+  undo_log.pos = undo_log.num_recs;
+  struct undo_rec *r = (struct undo_rec *) (undo_log.arena + undo_log.used);
+  undo_log.used += sz;
+  undo_log.bytes += sz;
+  memset(r, 0, sizeof *r);
+  r->type = type;
+  r->y = y;
+  r->x = x;
+  r->len = len;
+  r->room = sz - sizeof *r;
+  return r;
+}
+
+/* the last record, if this keystroke may add to it */
+struct undo_rec *
+undo_run(enum undo_type type, int y, size_t len)
+{
+  if (undo_log.run_tick + 1 != undo_log.tick
+      || undo_log.pos != undo_log.num_recs || undo_log.num_recs == 0)
+    return NULL;
+  struct undo_rec *r = undo_rec_at(undo_log.num_recs - 1);
+  if (r->type != type || r->y != y || r->ref
+      || r->len + len > UNDO_RUN_MAX || r->len + len > r->room)
+    return NULL;
+  return r;
+}
+
+/* s is about to go in at (y, x). run is for typing, which may be
+   merged with what was typed just before */
+void
+undo_record_insert(int y, int x, const char *s, size_t len, bool run)
+{
+  struct undo_rec *r = run ? undo_run(UNDO_INSERT, y, len) : NULL;
+  if (r && r->x + r->len == (size_t) x)
+    r->len += len;
+  else
+    {
+      r = undo_new(UNDO_INSERT, y, x, len, run ? UNDO_RUN_MAX : len);
+      r->len = len;
+    }
+  memcpy(undo_text(r) + r->len - len, s, len);
+  if (run)
+    undo_log.run_tick = undo_log.tick;
+}
+
+/* len bytes at (y, x) are about to be deleted, returns where to copy
+   them. run is for deleting a char at a time, either way */
+char *
+undo_record_delete(int y, int x, size_t len, bool run)
+{
+  struct undo_rec *r = run ? undo_run(UNDO_DELETE, y, len) : NULL;
+  char *out;
+  if (r && (size_t) r->x == x + len)
+    {
+      /* backward, ahead of the rest */
+      memmove(undo_text(r) + len, undo_text(r), r->len);
+      r->x = x;
+      r->len += len;
+      out = undo_text(r);
+    }
+  else if (r && r->x == x)
+    {
+      /* forward, after it */
+      out = undo_text(r) + r->len;
+      r->len += len;
+    }
+  else
+    {
+      r = undo_new(UNDO_DELETE, y, x, len, run ? UNDO_RUN_MAX : len);
+      out = undo_text(r);
+    }
+  if (run)
+    undo_log.run_tick = undo_log.tick;
+  return out;
+}
+
+/* a kill whose text is buf + off, which the log now owns */
+void
+undo_record_ref(int y, int x, char *buf, size_t off, size_t len)
+{
+  struct undo_rec *r = undo_new(UNDO_DELETE, y, x, len, 0);
+  r->ref = buf;
+  r->ref_off = off;
+  r->ref_sz = off + len + 1;
+  undo_log.bytes += r->ref_sz;
+}
+
+/* take back the last record, leaving the cursor where it was.
+   false if there's none */
+bool
+undo_undo(void)
+{
+  if (undo_log.pos == 0)
+    return false;
+  struct undo_rec *r = undo_rec_at(undo_log.pos - 1);
+  int y = r->y, x = r->x;
+  if (! (r->type == UNDO_INSERT ? editor_delete_text(y, x, r->len, NULL)
+         : editor_insert_text(&y, &x, undo_text(r), r->len)))
+    return false;
+  undo_log.pos--;
+  editor.cy = r->y;
+  editor.cx = r->x;
+  return true;
+}
+
+bool
+undo_redo(void)
+{
+  if (undo_log.pos == undo_log.num_recs)
+    return false;
+  struct undo_rec *r = undo_rec_at(undo_log.pos);
+  int y = r->y, x = r->x;
+  if (! (r->type == UNDO_INSERT ? editor_insert_text(&y, &x, undo_text(r),
+                                                     r->len)
+         : editor_delete_text(y, x, r->len, NULL)))
+    return false;
+  undo_log.pos++;
+  editor.cy = y;
+  editor.cx = x;
+  return true;
+}
+
+/* ================ diff ================ */
+
+/* le -d A B shows the two files side by side. every row is hashed
+ * once, and the diff only ever compares hashes. it is kept as a list of
+ * segments: runs of rows that are the same on both sides, changes, and
+ * stretches not diffed yet. those pending ones are split with Myers'
+ * linear space bisection only once the view reaches them, so a long
+ * file costs about as much as the screenful being looked at. */
+
+/* past this many edits a bisection settles for the furthest it got */
+#define DIFF_MAX_COST 1024
+/* pending stretches this small are diffed through right away, so that
+   a changed row ends up next to what it changed into */
+#define DIFF_EAGER 256
+
+enum diff_type
+{
+  DIFF_SAME,
+  DIFF_CHANGE,
+  DIFF_PENDING,
+};
+
+/* rows [a, a + n) on the left, [b, b + m) on the right */
+struct diff_seg
+{
+  int a, b;
+  int n, m;
+  enum diff_type type;
+};
+
+struct diff_view
+{
+  bool active;
+  /* the right side, the left is the editor's own rows */
+  struct editor_row *row;
+  int num_rows;
+  char *filename;
+  uint64_t *ha;
+  uint64_t *hb;
+  struct diff_seg *seg;
+  int num_segs;
+  int seg_cap;
+  /* the line at the top of the screen, never in a pending segment */
+  int top;
+  int top_off;
+} diff;
+
+#define DIFF_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* 16 bytes a round, in two independent lanes */
+uint64_t
+diff_hash(const char *s, int len)
+{
+  const uint64_t p1 = 0x9e3779b97f4a7c15ULL, p2 = 0xc2b2ae3d27d4eb4fULL;
+  uint64_t a = p1 ^ (uint64_t) len, b = p2;
+  uint64_t x, y;
+  for (; len >= 16; s += 16, len -= 16)
+    {
+      memcpy(&x, s, 8);
+      memcpy(&y, s + 8, 8);
+      a = DIFF_ROTL(a ^ x * p2, 31) * p1;
+      b = DIFF_ROTL(b ^ y * p1, 27) * p2;
+    }
+  if (len > 0)
+    {
+      char tail[16] = { 0 };
+      memcpy(tail, s, len);
+      memcpy(&x, tail, 8);
+      memcpy(&y, tail + 8, 8);
+      a = DIFF_ROTL(a ^ x * p2, 31) * p1;
+      b = DIFF_ROTL(b ^ y * p1, 27) * p2;
+    }
+  uint64_t h = a ^ DIFF_ROTL(b, 32);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t *
+diff_hash_rows(struct editor_row *row, int num_rows)
+{
+  uint64_t *h = malloc(sizeof *h * (num_rows ? num_rows : 1));
+  if (h == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  for (int i = 0; i < num_rows; i++)
+    h[i] = diff_hash(row[i].chars, row[i].size);
+  return h;
+}
+
+/* where an edit path through A[0, n) B[0, m) crosses the middle, in
+   (x, y). false if there's no point to split at */
+bool
+diff_bisect(const uint64_t *A, int n, const uint64_t *B, int m,
+            int *x, int *y)
+{
+  int max_d = (n + m + 1) / 2;
+  if (max_d > DIFF_MAX_COST)
+    max_d = DIFF_MAX_COST;
+  int off = max_d + 1;
+  int len = 2 * off + 1;
+  int *v1 = malloc(sizeof(int) * len * 2);
+  if (v1 == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  int *v2 = v1 + len;
+  for (int i = 0; i < len * 2; i++)
+    v1[i] = -1;
+  v1[off + 1] = v2[off + 1] = 0;
+
+  int delta = n - m;
+  bool front = delta & 1;
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  /* the furthest from either end a run of matching rows got, for when
+     it's too costly. splitting there keeps a change in one piece */
+  int best = 0, best_x = 0, best_y = 0;
+  bool found = false;
+
+  for (int d = 0; d < max_d && ! found; d++)
+    {
+      for (int k1 = -d + k1start; k1 <= d - k1end && ! found; k1 += 2)
+        {
+          int x1 = (k1 == -d || (k1 != d && v1[off + k1 - 1]
+                                 < v1[off + k1 + 1]))
+            ? v1[off + k1 + 1] : v1[off + k1 - 1] + 1;
+          int y1 = x1 - k1;
+          int snake = x1;
+          while (x1 < n && y1 < m && A[x1] == B[y1])
+            x1++, y1++;
+          v1[off + k1] = x1;
+          if (x1 > n)
+            k1end += 2;
+          else if (y1 > m)
+            k1start += 2;
+          else
+            {
+              if (x1 > snake && x1 + y1 > best)
+                {
+                  best = x1 + y1;
+                  best_x = x1;
+                  best_y = y1;
+                }
+              int k2 = off + delta - k1;
+              if (front && k2 >= 0 && k2 < len && v2[k2] != -1
+                  && x1 >= n - v2[k2])
+                {
+                  *x = x1;
+                  *y = y1;
+                  found = true;
+                }
+            }
+        }
+
+      for (int k2 = -d + k2start; k2 <= d - k2end && ! found; k2 += 2)
+        {
+          int x2 = (k2 == -d || (k2 != d && v2[off + k2 - 1]
+                                 < v2[off + k2 + 1]))
+            ? v2[off + k2 + 1] : v2[off + k2 - 1] + 1;
+          int y2 = x2 - k2;
+          int snake = x2;
+          while (x2 < n && y2 < m && A[n - x2 - 1] == B[m - y2 - 1])
+            x2++, y2++;
+          v2[off + k2] = x2;
+          if (x2 > n)
+            k2end += 2;
+          else if (y2 > m)
+            k2start += 2;
+          else
+            {
+              if (x2 > snake && x2 + y2 > best)
+                {
+                  best = x2 + y2;
+                  best_x = n - x2;
+                  best_y = m - y2;
+                }
+              int k1 = off + delta - k2;
+              if (! front && k1 >= 0 && k1 < len && v1[k1] != -1
+                  && v1[k1] >= n - x2)
+                {
+                  *x = v1[k1];
+                  *y = off + v1[k1] - k1;
+                  found = true;
+                }
+            }
+        }
+    }
+  free(v1);
+
+  if (! found)
+    {
+      *x = best_x;
+      *y = best_y;
+    }
+  /* it has to leave something on both sides */
+  return (*x + *y > 0) && (*x + *y < n + m);
+}
+
+void
+diff_push(struct diff_seg **out, int *num, int *cap, struct diff_seg s)
+{
+  if (s.n == 0 && s.m == 0)
+    return;
+  /* one change, or one run of the same, instead of several */
+  if (*num > 0 && s.type != DIFF_PENDING && (*out)[*num - 1].type == s.type)
+    {
+      (*out)[*num - 1].n += s.n;
+      (*out)[*num - 1].m += s.m;
+      return;
+    }
+  if (*num == *cap)
+    {
+      *cap = *cap ? *cap * 2 : 16;
+      struct diff_seg *seg = realloc(*out, sizeof *seg * *cap);
+      if (seg == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+      *out = seg;
+    }
+  (*out)[(*num)++] = s;
+}
+
+/* what pending segment s is made of, pushed to out. small ones are
+   diffed all the way through */
+void
+diff_split_into(struct diff_seg s, struct diff_seg **out, int *num,
+                int *cap)
+{
+  int pre = 0, suf = 0;
+  while (pre < s.n && pre < s.m && diff.ha[s.a + pre] == diff.hb[s.b + pre])
+    pre++;
+  while (suf < s.n - pre && suf < s.m - pre
+         && diff.ha[s.a + s.n - 1 - suf] == diff.hb[s.b + s.m - 1 - suf])
+    suf++;
+  diff_push(out, num, cap,
+            (struct diff_seg) { s.a, s.b, pre, pre, DIFF_SAME });
+
+  int a = s.a + pre, b = s.b + pre;
+  int n = s.n - pre - suf, m = s.m - pre - suf;
+  int x, y;
+  if (n == 0 || m == 0 || ! diff_bisect(&diff.ha[a], n, &diff.hb[b], m,
+                                         &x, &y))
+    diff_push(out, num, cap,
+              (struct diff_seg) { a, b, n, m, DIFF_CHANGE });
+  else if (n + m <= DIFF_EAGER)
+    {
+      diff_split_into((struct diff_seg) { a, b, x, y, DIFF_PENDING },
+                      out, num, cap);
+      diff_split_into((struct diff_seg) { a + x, b + y, n - x, m - y,
+                                          DIFF_PENDING }, out, num, cap);
+    }
+  else
+    {
+      diff_push(out, num, cap,
+                (struct diff_seg) { a, b, x, y, DIFF_PENDING });
+      diff_push(out, num, cap,
+                (struct diff_seg) { a + x, b + y, n - x, m - y,
+                                    DIFF_PENDING });
+    }
+
+  diff_push(out, num, cap,
+            (struct diff_seg) { a + n, b + m, suf, suf, DIFF_SAME });
+}
+
+/* replace pending segment i by its pieces, returns how many */
+int
+diff_split(int i)
+{
+  struct diff_seg *piece = NULL;
+  int k = 0, cap = 0;
+  diff_split_into(diff.seg[i], &piece, &k, &cap);
+
+  if (diff.num_segs + k - 1 > diff.seg_cap)
+    {
+      diff.seg_cap = (diff.num_segs + k) * 2;
+      struct diff_seg *seg = realloc(diff.seg, sizeof *seg * diff.seg_cap);
+      if (seg == NULL)
+        die(DIE_ERROR_FMT, "realloc");
+      diff.seg = seg;
+    }
+  memmove(&diff.seg[i + k], &diff.seg[i + 1],
+          sizeof *diff.seg * (diff.num_segs - i - 1));
+  memcpy(&diff.seg[i], piece, sizeof *piece * k);
+  diff.num_segs += k - 1;
+  if (diff.top > i)
+    diff.top += k - 1;
+  free(piece);
+  return k;
+}
+
+/* split segment i until it starts with something known */
+void
+diff_resolve_head(int i)
+{
+  while (diff.seg[i].type == DIFF_PENDING)
+    diff_split(i);
+}
+
+/* split segment i until it ends with something known, returns where
+   that last piece is */
+int
+diff_resolve_tail(int i)
+{
+  while (diff.seg[i].type == DIFF_PENDING)
+    i += diff_split(i) - 1;
+  return i;
+}
+
+/* lines a known segment takes on screen */
+int
+diff_seg_lines(struct diff_seg *s)
+{
+  return s->n > s->m ? s->n : s->m;
+}
+
+/* move the top of the view a line, false at either end */
+bool
+diff_down(void)
+{
+  if (diff.num_segs == 0)
+    return false;
+  if (diff.top_off + 1 < diff_seg_lines(&diff.seg[diff.top]))
+    diff.top_off++;
+  else if (diff.top + 1 < diff.num_segs)
+    {
+      diff_resolve_head(diff.top + 1);
+      diff.top++;
+      diff.top_off = 0;
+    }
+  else
+    return false;
+  return true;
+}
+
+bool
+diff_up(void)
+{
+  if (diff.top_off > 0)
+    diff.top_off--;
+  else if (diff.top > 0)
+    {
+      diff.top = diff_resolve_tail(diff.top - 1);
+      diff.top_off = diff_seg_lines(&diff.seg[diff.top]) - 1;
+    }
+  else
+    return false;
+  return true;
+}
+
+/* the start of the next or previous change, false if there's none */
+bool
+diff_find_change(bool forward)
+{
+  int i = diff.top;
+  if (forward)
+    {
+      while (diff.seg[i].type == DIFF_CHANGE)
+        {
+          if (++i >= diff.num_segs)
+            return false;
+          diff_resolve_head(i);
+        }
+      while (diff.seg[i].type != DIFF_CHANGE)
+        {
+          if (++i >= diff.num_segs)
+            return false;
+          diff_resolve_head(i);
+        }
+    }
+  else
+    {
+      if (diff.seg[i].type != DIFF_CHANGE || diff.top_off == 0)
+        do
+          {
+            if (--i < 0)
+              return false;
+            i = diff_resolve_tail(i);
+          }
+        while (diff.seg[i].type != DIFF_CHANGE);
+      /* a change can be cut in several by where it was split */
+      while (i > 0)
+        {
+          int j = diff_resolve_tail(i - 1);
+          if (diff.seg[j].type != DIFF_CHANGE)
+            {
+              i = j + 1;
+              break;
+            }
+          i = j;
+        }
+    }
+  diff.top = i;
+  diff.top_off = 0;
+  return true;
+}
+
+/* ================ hex view ================ */
+
+/* files that aren't text (a NUL in the first HEX_SNIFF_SZ bytes, like
+ * git and diff go by) or le -x are shown as HEX_ROW_SZ bytes a line,
+ * read straight out of a mapping of the file. line n starts at byte
+ * n * HEX_ROW_SZ, so there's no index to build, getting anywhere in a
+ * file of any size takes the same, and only lines on screen are ever
+ * formatted. */
+
+#define HEX_ROW_SZ 16
+#define HEX_SNIFF_SZ 8000
+/* "xxxx " for every 2 bytes, a space, then the bytes as text */
+#define HEX_COL_DIGITS(i) ((i) / 2 * 5 + (i) % 2 * 2)
+#define HEX_TEXT_COL (HEX_COL_DIGITS(HEX_ROW_SZ) + 1)
+
+struct hex_file
+{
+  const unsigned char *map;
+  /* what was mapped. size drops below it if the file shrinks */
+  off_t map_size;
+  off_t size;
+  /* the file, to see how much of the mapping is still backed by it */
+  int fd;
+  /* the byte under the cursor */
+  off_t at;
+  /* the line at the top of the screen */
+  off_t top;
+};
+
+/* le -x, for when it looks like text */
+bool hex_forced;
+
+/* digits of the offset column, 8 or as many as the file needs */
+int
+hex_addr_digits(off_t size)
+{
+  int n = 8;
+  while (n < 16 && (uint64_t) size >> (4 * n))
+    n++;
+  return n;
+}
+
+/* a line of the view, like xxd's, returns its length */
+int
+hex_format_row(const unsigned char *p, int n, off_t off, int digits,
+               char *out)
+{
+  static const char xdigit[] = "0123456789abcdef";
+  char hex[2 * HEX_ROW_SZ];
+  char text[HEX_ROW_SZ];
+  int i = 0;
+
+#ifdef __SSE2__
+  if (n == HEX_ROW_SZ)
+    {
+      /* both nibbles of every byte at once, as '0' + v or 'a' + v - 10,
+         then interleaved high and low */
+      __m128i v = _mm_loadu_si128((const __m128i *) p);
+      __m128i nib = _mm_set1_epi8(0x0f);
+      __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+      __m128i lo = _mm_and_si128(v, nib);
+      __m128i zero = _mm_set1_epi8('0');
+      __m128i nine = _mm_set1_epi8(9);
+      __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+      hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+                        _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+      lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+                        _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+      _mm_storeu_si128((__m128i *) hex, _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128((__m128i *) (hex + 16), _mm_unpackhi_epi8(hi, lo));
+
+      /* printable ASCII as is, the rest as dots. bytes from 0x80 up are
+         negative, which fails the first compare */
+      __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+                                 _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+      _mm_storeu_si128((__m128i *) text,
+                       _mm_or_si128(_mm_and_si128(ok, v),
+                                    _mm_andnot_si128(ok,
+                                                     _mm_set1_epi8('.'))));
+      i = HEX_ROW_SZ;
+    }
+#endif
+  for (; i < n; i++)
+    {
+      hex[2 * i] = xdigit[p[i] >> 4];
+      hex[2 * i + 1] = xdigit[p[i] & 0x0f];
+      text[i] = p[i] >= 0x20 && p[i] < 0x7f ? p[i] : '.';
+    }
+
+  int len = snprintf(out, 20, "%0*llx: ", digits, (unsigned long long) off);
+  char *q = out + len;
+  for (i = 0; i < HEX_ROW_SZ; i += 2)
+    {
+      /* the last line may be short, keep the text where it goes */
+      for (int j = i; j < i + 2; j++)
+        {
+          *q++ = j < n ? hex[2 * j] : ' ';
+          *q++ = j < n ? hex[2 * j + 1] : ' ';
+        }
+      *q++ = ' ';
+    }
+  *q++ = ' ';
+  memcpy(q, text, n);
+  return q + n - out;
+}
+
+/* a mapped page the file no longer reaches, between our last look at
+   its size and the read. put the terminal back and say why */
+void
+handle_sigbus(int sig [[maybe_unused]])
+{
+  static const char msg[] = ": the file shrank while it was read\n";
+  disable_raw_mode();
+  write(STDERR_FILENO, progname, strlen(progname));
+  write(STDERR_FILENO, msg, sizeof msg - 1);
+  _exit(EXIT_FAILURE);
+}
+
+/* map the file fp is open on instead of reading it into rows */
+void
+hex_open(FILE *fp)
+{
+  struct stat st;
+  if (fstat(fileno(fp), &st) == -1)
+    die(DIE_ERROR_FMT, "fstat");
+  struct hex_file *hex = calloc(1, sizeof *hex);
+  if (hex == NULL)
+    die(DIE_ERROR_FMT, "calloc");
+  hex->size = hex->map_size = st.st_size;
+  if ((hex->fd = dup(fileno(fp))) == -1)
+    die(DIE_ERROR_FMT, "dup");
+  if (hex->size > 0)
+    {
+      void *map = mmap(NULL, hex->size, PROT_READ, MAP_PRIVATE,
+                       fileno(fp), 0);
+      if (map == MAP_FAILED)
+        die(DIE_ERROR_FMT, "mmap");
+      hex->map = map;
+
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = handle_sigbus;
+      sigemptyset(&sa.sa_mask);
+      if (sigaction(SIGBUS, &sa, NULL) == -1)
+        die(DIE_ERROR_FMT, "sigaction");
+    }
+  editor.hex = hex;
+  editor_file_seen(&st);
+  fclose(fp);
+}
+
+void
+hex_close(struct hex_file *hex)
+{
+  if (hex->map)
+    munmap((void *) hex->map, hex->map_size);
+  close(hex->fd);
+  free(hex);
+}
+
+off_t
+hex_num_rows(struct hex_file *hex)
+{
+  return (hex->size + HEX_ROW_SZ - 1) / HEX_ROW_SZ;
+}
+
+/* put the cursor on byte at, within the file */
+void
+hex_goto(struct hex_file *hex, off_t at)
+{
+  if (at > hex->size - 1)
+    at = hex->size - 1;
+  if (at < 0)
+    at = 0;
+  hex->at = at;
+}
+
+/* past the end of a file that shrank, reading the mapping is SIGBUS.
+   keep to what's left of it */
+void
+hex_check_size(struct hex_file *hex)
+{
+  struct stat st;
+  if (fstat(hex->fd, &st) == -1 || st.st_size >= hex->size)
+    return;
+  hex->size = st.st_size;
+  hex_goto(hex, hex->at);
+  if (hex->top > hex_num_rows(hex) - 1)
+    hex->top = hex_num_rows(hex) - 1;
+  if (hex->top < 0)
+    hex->top = 0;
+  editor_set_status_msg("%s shrank on disk", editor.filename);
+}
+
+/* ================ file i/o ================ */
+
+/* apply the journal a session that died left behind, if it was for
+   the file just as we read it */
+void
+journal_replay(void)
+{
+  /* the hex view is never edited */
+  if (editor.hex)
+    return;
+  journal.path = journal_path(editor.filename);
+  FILE *fp = fopen(journal.path, "r");
+  if (fp == NULL)
+    return;
+
+  struct journal_header h, want;
+  journal_header(&want);
+  if (fread(&h, sizeof h, 1, fp) != 1 || memcmp(&h, &want, sizeof h) != 0)
+    {
+      fclose(fp);
+      editor_set_status_msg("Ignoring a journal for another version of "
+                            "%.30s", editor.filename);
+      return;
+    }
+
+  journal.replaying = true;
+  int edits = 0;
+  long end = ftell(fp);
+  char *text = NULL;
+  struct journal_rec rec;
+  while (fread(&rec, sizeof rec, 1, fp) == 1)
+    {
+      /* a torn record at the end is as far as it got */
+      if (rec.type == JOURNAL_INSERT)
+        {
+          char *buf = realloc(text, rec.len ? rec.len : 1);
+          if (buf == NULL)
+            break;
+          text = buf;
+          if (fread(text, 1, rec.len, fp) != rec.len)
+            break;
+          int y = rec.y, x = rec.x;
+          if (! editor_insert_text(&y, &x, text, rec.len))
+            break;
+        }
+      else if (rec.type != JOURNAL_DELETE
+               || ! editor_delete_text(rec.y, rec.x, rec.len, NULL))
+        break;
+      edits++;
+      end = ftell(fp);
+    }
+  free(text);
+  fclose(fp);
+  journal.replaying = false;
+
+  if (edits == 0)
+    return;
+  /* carry on where it left off */
+  journal.fd = open(journal.path, O_WRONLY | O_APPEND);
+  if (journal.fd != -1 && ftruncate(journal.fd, end) == -1)
+    {
+      close(journal.fd);
+      journal.fd = -1;
+    }
+  editor_set_status_msg("Recovered %d edit%s from %.30s", edits,
+                        edits == 1 ? "" : "s", journal.path);
+}
+
+/* read a file into the buffer */
+void
+editor_load(char *filename)
+{
+  free(editor.filename);
+  editor.filename = strdup(filename);
+  editor_select_syntax();
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+	die(DIE_ERROR_FMT, "fopen");
+
+  unsigned char head[HEX_SNIFF_SZ];
+  size_t nhead = fread(head, 1, sizeof(head), fp);
+  rewind(fp);
+  if (hex_forced)
+    {
+      hex_open(fp);
+      return;
+    }
+  if (nhead >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+    {
+      /* fp stays open, rows are decompressed from it on demand */
+      gz_open(fp);
+      return;
+    }
+  if (nhead >= 4 && memcmp(head, "\x28\xb5\x2f\xfd", 4) == 0)
+    die(DIE_MSG_FMT, "zstd compressed files are not supported");
+  if (memchr(head, '\0', nhead))
+    {
+      hex_open(fp);
+      return;
+    }
+  
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  off_t off = 0;
+
+  while (
+		 (linelen = getline(&line, &linecap, fp)) != -1)
+	{
+      off_t row_off = off;
+      off += linelen;
+      /* "\n" or "\r\n" ends it, any other '\r' is part of the row so
+         it gets written back as it was */
+      ssize_t full = linelen;
+	  if (linelen > 0 && line[linelen - 1] == '\n')
+		{
+		  linelen--;
+		  if (linelen > 0 && line[linelen - 1] == '\r')
+			linelen--;
+		}
+      if (linelen >= ROW_LONG_SZ)
+        {
+          editor_adopt_row(line, linelen, row_off);
+          line = NULL;
+          linecap = 0;
+        }
+      else
+        editor_append_row(line, linelen, row_off);
+      editor.row[editor.num_rows - 1].eol = full - linelen;
+	}
+  if (ferror(fp))
+	die(DIE_ERROR_FMT, "getline");
+  free(line);
+  if (editor.num_rows > 0 && editor.row[0].eol == 2)
+    editor.eol = 2;
+
+  /* saving copies the rows we don't change straight out of it */
+  struct stat st;
+  editor.fd = dup(fileno(fp));
+  if (editor.fd == -1 || fstat(editor.fd, &st) == -1)
+    die(DIE_ERROR_FMT, "dup");
+  editor_file_seen(&st);
+  fclose(fp);
+}
+
+// maybe add a simple UTF-8 check ... do not support :)
+// and make POSIXly
+void
+editor_open(char *filename)
+{
+  editor_load(filename);
+  journal_replay();
+}
+
+/* let go of the buffer and everything it holds */
+void
+editor_close(void)
+{
+  for (int i = 0; i < editor.num_rows; i++)
+    {
+      struct editor_row *row = &editor.row[i];
+      free(row->chars);
+      free(row->render);
+      free(row->rcol);
+      free(row->chunk);
+      free(row->hl);
+    }
+  free(editor.row);
+  editor.row = NULL;
+  editor.num_rows = editor.row_cap = 0;
+  editor.wrap_tree_rows = -1;
+  free(editor.filename);
+  editor.filename = NULL;
+  if (editor.gz)
+    gz_close(editor.gz);
+  editor.gz = NULL;
+  if (editor.hex)
+    hex_close(editor.hex);
+  editor.hex = NULL;
+  if (editor.fd != -1)
+    close(editor.fd);
+  editor.fd = -1;
+}
+
+/* compare the left file against the right one */
+void
+diff_open(char *left, char *right)
+{
+  diff.active = true;
+
+  editor_load(right);
+  if (editor.gz || editor.hex)
+    die(DIE_MSG_FMT, "only text files can be diffed");
+  diff.row = editor.row;
+  diff.num_rows = editor.num_rows;
+  diff.filename = editor.filename;
+  editor.row = NULL;
+  editor.num_rows = editor.row_cap = 0;
+  editor.filename = NULL;
+  close(editor.fd);
+  editor.fd = -1;
+
+  editor_load(left);
+  if (editor.gz || editor.hex)
+    die(DIE_MSG_FMT, "only text files can be diffed");
+  editor.syntax = NULL;
+
+  diff.ha = diff_hash_rows(editor.row, editor.num_rows);
+  diff.hb = diff_hash_rows(diff.row, diff.num_rows);
+  diff.seg = malloc(sizeof *diff.seg);
+  if (diff.seg == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  diff.seg_cap = 1;
+  diff.seg[0] = (struct diff_seg) { 0, 0, editor.num_rows, diff.num_rows,
+                                    DIFF_PENDING };
+  diff.num_segs = editor.num_rows + diff.num_rows > 0;
+  diff.top = diff.top_off = 0;
+  if (diff.num_segs)
+    diff_resolve_head(0);
+}
+	  
+/* ================ saving ================ */
+
+/* a save writes rows straight out of their own storage, never joining
+ * them into one buffer. rows unchanged since they were read are still
+ * laid out back to back in the file we read them from, so runs of them
+ * are copied over from it in the kernel. the rest go out through
+ * writev. it all lands in a temp file next to the real one, which is
+ * synced and renamed over it. */
+
+#ifdef IOV_MAX
+#define SAVE_IOV_MAX (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#else
+#define SAVE_IOV_MAX 1024
+#endif
+/* for copying a span by hand when copy_file_range can't */
+#define SAVE_COPY_SZ (64 * 1024)
+
+struct save_state
+{
+  /* the temp file */
+  int fd;
+  struct iovec iov[SAVE_IOV_MAX];
+  int iovcnt;
+  /* cleared the first time copy_file_range says no */
+  bool copy_range;
+};
+
+/* the line terminator a row is written out with from memory */
+const char *
+editor_row_eol(int at, int *len)
+{
+  int n = editor.row[at].eol;
+  /* rows after it need a line of their own */
+  if (n == 0 && at < editor.num_rows - 1)
+    n = editor.eol;
+  *len = n;
+  return n == 2 ? "\r\n" : "\n";
+}
+
+int
+save_flush(struct save_state *st)
+{
+  struct iovec *iov = st->iov;
+  int cnt = st->iovcnt;
+  st->iovcnt = 0;
+  while (cnt > 0)
+    {
+      ssize_t n = writev(st->fd, iov, cnt);
+      if (n == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      /* short write, pick up where it left off */
+      while (cnt > 0 && (size_t) n >= iov->iov_len)
+        {
+          n -= iov->iov_len;
+          iov++;
+          cnt--;
+        }
+      if (cnt > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + n;
+          iov->iov_len -= n;
+        }
+    }
+  return 0;
+}
+
+int
+save_push(struct save_state *st, const char *s, size_t len)
+{
+  if (len == 0)
+    return 0;
+  if (st->iovcnt == SAVE_IOV_MAX && save_flush(st) == -1)
+    return -1;
+  st->iov[st->iovcnt].iov_base = (char *) s;
+  st->iov[st->iovcnt].iov_len = len;
+  st->iovcnt++;
+  return 0;
+}
+
+/* copy [off, off + len) of src to the end of the temp file */
+int
+save_copy(struct save_state *st, int src, off_t off, off_t len)
+{
+  if (save_flush(st) == -1)
+    return -1;
+
+#ifdef __linux__
+  while (st->copy_range && len > 0)
+    {
+      ssize_t n = copy_file_range(src, &off, st->fd, NULL, len, 0);
+      if (n > 0)
+        len -= n;
+      else if (n == -1 && errno == EINTR)
+        continue;
+      else if (n == 0 || errno == EXDEV || errno == ENOSYS
+               || errno == EINVAL || errno == EOPNOTSUPP)
+        st->copy_range = false;
+      else
+        return -1;
+    }
+#endif
+
+  static char buf[SAVE_COPY_SZ];
+  while (len > 0)
+    {
+      ssize_t n = pread(src, buf, len < SAVE_COPY_SZ ? len : SAVE_COPY_SZ,
+                        off);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        return -1;
+      if (n == 0)
+        {
+          /* the file shrank under us */
+          errno = EIO;
+          return -1;
+        }
+      for (ssize_t done = 0; done < n; )
+        {
+          ssize_t w = write(st->fd, buf + done, n - done);
+          if (w == -1 && errno == EINTR)
+            continue;
+          if (w == -1)
+            return -1;
+          done += w;
+        }
+      off += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* write the buffer to path, -1 with errno set if it didn't work out */
+int
+editor_write_file(const char *path)
+{
+  /* the rows we never touched are only where we left them if
+     nobody else wrote the file since */
+  struct stat st_src;
+  bool reuse = editor.fd != -1 && fstat(editor.fd, &st_src) == 0
+    && editor_file_same(&st_src);
+
+  /* through symlinks, to replace what they point at */
+  char *real = realpath(path, NULL);
+  const char *target = real ? real : path;
+
+  mode_t mode;
+  struct stat st;
+  if (stat(target, &st) == 0)
+    mode = st.st_mode & 07777;
+  else
+    {
+      mode_t mask = umask(0);
+      umask(mask);
+      mode = 0666 & ~mask;
+    }
+
+  /* next to it, so the rename stays within one filesystem */
+  size_t len = strlen(target);
+  char *tmp = malloc(len + sizeof(".le-XXXXXX"));
+  if (tmp == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  memcpy(tmp, target, len);
+  memcpy(tmp + len, ".le-XXXXXX", sizeof(".le-XXXXXX"));
+
+  struct save_state *save = malloc(sizeof *save);
+  if (save == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  save->iovcnt = 0;
+  save->copy_range = true;
+  save->fd = mkstemp(tmp);
+  if (save->fd == -1)
+    goto fail;
+
+  for (int i = 0; i < editor.num_rows; )
+    {
+      struct editor_row *row = &editor.row[i];
+      if (reuse && ! row->dirty)
+        {
+          off_t start = row->off;
+          off_t end = row->off + row->size + row->eol;
+          for (i++; i < editor.num_rows && ! editor.row[i].dirty
+                 && editor.row[i].off == end; i++)
+            end += editor.row[i].size + editor.row[i].eol;
+          if (save_copy(save, editor.fd, start, end - start) == -1)
+            goto fail;
+          continue;
+        }
+
+      int eol_len;
+      const char *eol = editor_row_eol(i, &eol_len);
+      if (save_push(save, row->chars, row->size) == -1
+          || save_push(save, eol, eol_len) == -1)
+        goto fail;
+      i++;
+    }
+
+  if (save_flush(save) == -1
+      || fchmod(save->fd, mode) == -1
+      || fsync(save->fd) == -1
+      || rename(tmp, target) == -1)
+    goto fail;
+
+  /* the rename itself needs to reach the disk too */
+  char *slash = strrchr(target, '/');
+  char *dir = slash ? strndup(target, slash == target ? 1 : slash - target)
+    : strdup(".");
+  int dir_fd = dir ? open(dir, O_RDONLY) : -1;
+  if (dir_fd != -1)
+    {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+  free(dir);
+
+  /* the rows now live in the new file, where the temp fd points */
+  off_t off = 0;
+  for (int i = 0; i < editor.num_rows; i++)
+    {
+      struct editor_row *row = &editor.row[i];
+      if (! reuse || row->dirty)
+        editor_row_eol(i, &row->eol);
+      row->off = off;
+      off += row->size + row->eol;
+      row->dirty = false;
+    }
+  if (editor.fd != -1)
+    close(editor.fd);
+  editor.fd = save->fd;
+  if (fstat(editor.fd, &st) == 0)
+    editor_file_seen(&st);
+  editor.dirty = false;
+
+  free(save);
+  free(tmp);
+  free(real);
+  return 0;
+
+ fail:
+  {
+    int saved_errno = errno;
+    if (save->fd != -1)
+      {
+        close(save->fd);
+        unlink(tmp);
+      }
+    free(save);
+    free(tmp);
+    free(real);
+    errno = saved_errno;
+  }
+  return -1;
+}
+
+/* ================ input ================ */
+
+void
+editor_set_status_msg(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(editor.status_msg,
+            sizeof(editor.status_msg),
+            fmt,
+            ap);
+  va_end(ap);
+  editor.status_msg_time = time(NULL);
+}
+
+/* read a line in the msg bar, fmt gets the input so far,
+   NULL if they quit with C-g */
+char *
+editor_prompt(const char *fmt)
+{
+  size_t cap = 128;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL)
+    die(DIE_ERROR_FMT, "malloc");
+  buf[0] = '\0';
+
+  while (1)
+    {
+      editor_set_status_msg(fmt, buf);
+      editor_refresh_screen();
+
+      int c = editor_read_key();
+      if (c == DEL_BACKWARD_CHAR || c == CTRL('H'))
+        {
+          if (len != 0)
+            buf[--len] = '\0';
+        }
+      else if (c == CTRL('G') || c == '\x1b')
+        {
+          editor_set_status_msg("Quit");
+          free(buf);
+          return NULL;
+        }
+      else if (c == '\r')
+        {
+          editor_set_status_msg("");
+          return buf;
+        }
+      else if (c < 128 && ! iscntrl(c))
+        {
+          if (len == cap - 1)
+            {
+              char *new_buf = realloc(buf, cap *= 2);
+              if (new_buf == NULL)
+                die(DIE_ERROR_FMT, "realloc");
+              buf = new_buf;
+            }
+          buf[len++] = c;
+          buf[len] = '\0';
+        }
+    }
+}
+
+void
+editor_goto_line(void)
+{
+  char *input = editor_prompt("Goto line: %s");
+  if (input == NULL)
+    return;
+  int line = atoi(input);
+  free(input);
+
+  if (line > editor.num_rows)
+    line = editor.num_rows;
+  editor.cy = line > 0 ? line - 1 : 0;
+  editor.cx = 0;
+  /* recenter if it's off screen, rows of compressed files are only
+     decompressed once they get drawn */
+  if (editor.cy < editor.row_offset
+      || editor.cy >= editor.row_offset + editor.window_rows)
+    {
+      editor.row_offset = editor.cy - editor.window_rows / 2;
+      if (editor.row_offset < 0)
+        editor.row_offset = 0;
+    }
+}
+
+/* C-x x t, like toggle-truncate-lines */
+void
+wrap_toggle(void)
+{
+  editor.wrap = ! editor.wrap;
+  editor.col_offset = 0;
+  editor.wrap_offset = 0;
+  editor_set_status_msg("Truncate long lines %s",
+                        editor.wrap ? "disabled" : "enabled");
+}
+
+/* whether there's a line after row at, the one past the end only
+   being there after a newline */
+bool
+editor_row_has_next(int at)
+{
+  return at + 1 < editor.num_rows || editor.row[at].eol > 0;
+}
+
+/* the cursor to the very end, which is the line past the last row only
+   if that row ends in a newline */
+void
+editor_goto_end(void)
+{
+  editor.cy = editor.num_rows;
+  editor.cx = 0;
+  if (editor.num_rows > 0 && ! editor_row_has_next(editor.num_rows - 1))
+    {
+      editor.cy--;
+      editor.cx = editor.row[editor.cy].size;
+    }
+}
+
+void
+editor_move_cursor(int c)
+{
+  // get the row the cursor is on
+  // can be one row past the end, >= vs. ==
+  struct editor_row *row =
+	(editor.cy >= editor.num_rows) ?
+	NULL : editor_row_load(editor.cy);
+  // a page scroll changes the row under cx, keep it on this one
+  if (row && editor.cx > row->size)
+    editor.cx = row->size;
+  // keep the screen column, not the byte, going up and down
+  int rx = row ? editor_row_cx_to_rx(row, editor.cx) : 0;
+	
+  switch (c)
+	{
 	case FORWARD_CHAR:
 	  // can't go past end
 	  if (row && editor.cx < row->size)
-		editor.cx++;
+        {
+          editor.cx++;
+          // all of a multi-byte char
+          while (editor.cx < row->size && UTF8_CONT(row->chars[editor.cx]))
+            editor.cx++;
+        }
 	  // at the end (or one past I guess -- to type)
 	  // also not on the last line (or the one that has nothing)
-	  else if (row && editor.cx  == row->size)
+	  else if (row && editor.cx  == row->size
+               && editor_row_has_next(editor.cy))
 		{
 		  editor.cy++;
 		  editor.cx = 0;
 		}
       else
         {
-          write(STDOUT_FILENO, "\a", 1);
+          editor_ding();
           editor_set_status_msg("End of buffer");
         }
 	  break;	  
 	case BACKWARD_CHAR:
 	  if (editor.cx != 0)
-		editor.cx--;
+        {
+          editor.cx--;
+          while (editor.cx > 0 && UTF8_CONT(row->chars[editor.cx]))
+            editor.cx--;
+        }
 	  // beg. of a line and it's not the first, move to end of prev.
 	  else if (editor.cy > 0)
 		{
@@ -670,26 +4747,53 @@ editor_move_cursor(int c)
 		}
       else
         {
-          write(STDOUT_FILENO, "\a", 1);
+          editor_ding();
           editor_set_status_msg("End of buffer");
         }
 	  break;
 	case PREV_LINE:
+      if (editor.wrap)
+        {
+          /* by visual line, within the row first */
+          int start = 0;
+          int sub = row ? wrap_locate(row, rx, &start) : 0;
+          if (sub > 0)
+            {
+              editor.cx = editor_row_rx_to_cx(row, rx - start
+                                              + wrap_line_start(row, sub - 1));
+              return;
+            }
+          if (editor.cy != 0)
+            rx += wrap_line_start(editor_row_load(editor.cy - 1),
+                                  wrap_refresh(editor.cy - 1) - 1);
+        }
 	  if (editor.cy != 0)	  
 		editor.cy--;
       else
         {
-          write(STDOUT_FILENO, "\a", 1);
+          editor_ding();
           editor_set_status_msg("End of buffer");
         }
 	  break;
 	case NEXT_LINE:
-	  // let scroll one past bottom
-	  if (editor.cy < editor.num_rows)
+      if (editor.wrap && row)
+        {
+          int start;
+          int sub = wrap_locate(row, rx, &start);
+          if (sub + 1 < wrap_refresh(editor.cy))
+            {
+              editor.cx = editor_row_rx_to_cx(row, rx - start
+                                              + wrap_line_start(row, sub + 1));
+              return;
+            }
+          rx -= start;
+        }
+	  // let scroll one past bottom, if the last row ends in a newline
+	  if (editor.cy < editor.num_rows && editor_row_has_next(editor.cy))
 		editor.cy++;
       else
         {
-          write(STDOUT_FILENO, "\a", 1);
+          editor_ding();
           editor_set_status_msg("End of buffer");
         }
 	  break;
@@ -698,46 +4802,768 @@ editor_move_cursor(int c)
   // snap back cursor if go to line with longer line of text
   row = (editor.cy >= editor.num_rows) ?
 	NULL : &editor.row[editor.cy];
+  if (row && (c == PREV_LINE || c == NEXT_LINE))
+    editor.cx = editor_row_rx_to_cx(editor_row_load(editor.cy), rx);
   int rowlen = row ? row->size : 0;
   if (editor.cx > rowlen)
 	editor.cx = rowlen;
 }
 
+/* compressed buffers are only for looking at */
+bool
+editor_read_only(void)
+{
+  if (editor.gz == NULL)
+    return false;
+  editor_ding();
+  editor_set_status_msg("Buffer is read-only");
+  return true;
+}
+
+/* type c, along with the rest of its UTF-8 sequence */
+void
+editor_self_insert(int c)
+{
+  char buf[4];
+  int len = 1;
+  buf[0] = c;
+  if (c >= 0xc0)
+    for (int more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1; more > 0; more--)
+      {
+        int k = editor_read_key();
+        if (k < 0x80 || k >= 0xc0)
+          break;
+        buf[len++] = k;
+      }
+
+  if (editor_read_only() || ! editor_text_pos_ok(editor.cy, editor.cx, true))
+    return;
+  undo_record_insert(editor.cy, editor.cx, buf, len, true);
+  editor_insert_text(&editor.cy, &editor.cx, buf, len);
+}
+
+void
+editor_newline(void)
+{
+  if (editor_read_only() || ! editor_text_pos_ok(editor.cy, editor.cx, true))
+    return;
+  undo_record_insert(editor.cy, editor.cx, "\n", 1, false);
+  editor_insert_text(&editor.cy, &editor.cx, "\n", 1);
+}
+
+/* the char after the cursor, or before it, joining rows at the ends */
+void
+editor_delete_char(bool forward)
+{
+  if (editor_read_only())
+    return;
+
+  int y = editor.cy, x = editor.cx, len = 1;
+  /* past the end, backing up takes the '\n' the buffer ends with */
+  if (y >= editor.num_rows && ! forward && y > 0
+      && editor.row[y - 1].eol > 0)
+    {
+      y--;
+      x = editor.row[y].size;
+      forward = true;
+    }
+  else if (y >= editor.num_rows)
+    {
+      /* nothing to delete past the end, just go back */
+      if (! forward && y > 0)
+        editor_move_cursor(BACKWARD_CHAR);
+      else
+        {
+          editor_ding();
+          editor_set_status_msg("End of buffer");
+        }
+      return;
+    }
+
+  struct editor_row *row = &editor.row[y];
+  if (forward)
+    {
+      if (x < row->size)
+        while (x + len < row->size && UTF8_CONT(row->chars[x + len]))
+          len++;
+      else if (! editor_row_has_next(y))
+        {
+          editor_ding();
+          editor_set_status_msg("End of buffer");
+          return;
+        }
+    }
+  else
+    {
+      if (x > 0)
+        {
+          int from = x - 1;
+          while (from > 0 && UTF8_CONT(row->chars[from]))
+            from--;
+          len = x - from;
+          x = from;
+        }
+      else if (y > 0)
+        {
+          y--;
+          x = editor.row[y].size;
+        }
+      else
+        {
+          editor_ding();
+          editor_set_status_msg("Beginning of buffer");
+          return;
+        }
+    }
+
+  char *out = undo_record_delete(y, x, len, true);
+  editor_delete_text(y, x, len, out);
+  editor.cy = y;
+  editor.cx = x;
+}
+
+/* the rest of the row, or the line break if there is no rest */
+void
+editor_kill_line(void)
+{
+  if (editor_read_only())
+    return;
+
+  int y = editor.cy, x = editor.cx;
+  if (y >= editor.num_rows
+      || (x == editor.row[y].size && ! editor_row_has_next(y)))
+    {
+      editor_ding();
+      editor_set_status_msg("End of buffer");
+      return;
+    }
+
+  size_t len = editor.row[y].size - x;
+  if (len == 0)
+    len = 1;
+  else if (len >= UNDO_REF_MIN && (size_t) x < len)
+    {
+      /* the log gets the row's old buffer, the row a copy of the
+         smaller part that stays */
+      char *old = editor_row_take_tail(y, x);
+      undo_record_ref(y, x, old, x, len);
+      return;
+    }
+
+  char *out = undo_record_delete(y, x, len, false);
+  editor_delete_text(y, x, len, out);
+}
+
+void
+editor_undo(bool redo)
+{
+  if (editor_read_only())
+    return;
+  if (redo ? undo_redo() : undo_undo())
+    editor_set_status_msg(redo ? "Redo" : "Undo");
+  else
+    {
+      editor_ding();
+      editor_set_status_msg(redo ? "No further redo information"
+                            : "No further undo information");
+    }
+}
+
+/* save to the file we have, or ask for one */
+void
+editor_save(bool ask)
+{
+  if (editor.gz)
+    {
+      editor_set_status_msg("Compressed files are read-only");
+      return;
+    }
+
+  char *path = NULL;
+  if (ask || editor.filename == NULL)
+    {
+      path = editor_prompt("Write file: %s");
+      if (path == NULL)
+        return;
+      if (path[0] == '\0')
+        {
+          free(path);
+          editor_set_status_msg("No file name given");
+          return;
+        }
+    }
+  else if (! editor.dirty)
+    {
+      editor_set_status_msg("(No changes need to be saved)");
+      return;
+    }
+
+  if (editor_write_file(path ? path : editor.filename) == -1)
+    {
+      editor_set_status_msg("Error writing %.40s: %s",
+                            path ? path : editor.filename, strerror(errno));
+      free(path);
+      return;
+    }
+
+  /* what it had is in the file now */
+  journal_stop(true);
+
+  if (path)
+    {
+      free(editor.filename);
+      editor.filename = path;
+      /* a new name may mean a new language */
+      struct editor_syntax *old = editor.syntax;
+      editor_select_syntax();
+      if (editor.syntax != old)
+        {
+          for (int i = 0; i < editor.num_rows; i++)
+            {
+              free(editor.row[i].hl);
+              editor.row[i].hl = NULL;
+            }
+          editor.hl_valid_to = 0;
+          editor.hl_known_to = 0;
+        }
+    }
+  editor_set_status_msg("Wrote %.60s", editor.filename);
+}
+
+/* C-u, then digits or more C-u's, each of which is times 4. the
+   key after it goes in key */
+int
+editor_universal_arg(int *key)
+{
+  int arg = 4;
+  bool digits = false;
+  while (1)
+    {
+      editor_set_status_msg("C-u %d-", arg);
+      editor_refresh_screen();
+      int k = editor_read_key();
+      if (k == UNIVERSAL_ARG && ! digits)
+        arg *= 4;
+      else if (k >= '0' && k <= '9' && (! digits || arg < INT_MAX / 10 - 9))
+        {
+          arg = digits ? arg * 10 + k - '0' : k - '0';
+          digits = true;
+        }
+      else
+        {
+          editor_set_status_msg("");
+          *key = k;
+          return arg;
+        }
+    }
+}
+
+void
+kbd_macro_start(void)
+{
+  if (macro.recording)
+    {
+      editor_ding();
+      editor_set_status_msg("Already defining kbd macro");
+      return;
+    }
+  macro.recording = true;
+  macro.len = 0;
+  editor_set_status_msg("Defining kbd macro...");
+}
+
+void
+kbd_macro_end(void)
+{
+  if (! macro.recording)
+    {
+      editor_ding();
+      editor_set_status_msg("Not defining kbd macro");
+      return;
+    }
+  /* the C-x ) that ended it */
+  macro.len -= 2;
+  macro.recording = false;
+  editor_set_status_msg("Keyboard macro defined");
+}
+
+/* run the macro count times, or until it fails if count is 0. the
+   commands only see the buffer, the screen is drawn after */
+/* a C-g typed while a macro runs stops it, and throws away what was
+   typed before it */
+bool
+kbd_macro_quit(void)
+{
+  read_ahead();
+  char *quit = memchr(&ahead.buf[ahead.at], CTRL('G'),
+                      ahead.len - ahead.at);
+  if (quit == NULL)
+    return false;
+  ahead.at = quit - ahead.buf + 1;
+  editor_ding();
+  editor_set_status_msg("Quit");
+  return true;
+}
+
+void
+kbd_macro_call(int count)
+{
+  if (macro.replaying)
+    {
+      /* a macro calling itself */
+      macro.failed = true;
+      return;
+    }
+  if (macro.recording)
+    {
+      editor_ding();
+      editor_set_status_msg("Can't execute a kbd macro while defining it");
+      return;
+    }
+  if (macro.len == 0)
+    {
+      editor_ding();
+      editor_set_status_msg("No kbd macro has been defined");
+      return;
+    }
+
+  macro.replaying = true;
+  macro.failed = false;
+  for (int n = 0; (count == 0 || n < count) && ! macro.failed; n++)
+    {
+      if (n > 0 && kbd_macro_quit())
+        break;
+      int cx = editor.cx, cy = editor.cy;
+      unsigned long edits = editor.edits;
+      for (macro.at = 0; macro.at < macro.len && ! macro.failed; )
+        {
+          editor_process_keystroke();
+          /* commands like C-v go by where the screen would be */
+          editor_scroll();
+        }
+      /* C-u 0 would go on forever with a macro that can't fail, stop
+         once a round of it does nothing */
+      if (count == 0 && cx == editor.cx && cy == editor.cy
+          && edits == editor.edits)
+        break;
+    }
+  macro.replaying = false;
+}
+
+/* the cursor to what's on line y of the screen at column x, or as close
+   as there's text to */
+void
+editor_place_cursor(int y, int x)
+{
+  if (editor.num_rows == 0)
+    {
+      editor.cy = editor.cx = 0;
+      return;
+    }
+
+  int at, rx;
+  if (editor.wrap)
+    {
+      /* down from the top through counts made right for this width */
+      at = editor.row_offset;
+      int lines, sub = editor.wrap_offset + y;
+      if (at >= editor.num_rows)
+        at = editor.num_rows - 1;
+      while ((lines = wrap_refresh(at)) <= sub && at < editor.num_rows - 1)
+        {
+          sub -= lines;
+          at++;
+        }
+      if (sub >= lines)
+        sub = lines - 1;
+      struct editor_row *row = editor_row_load(at);
+      rx = wrap_line_start(row, sub) + x;
+      /* not past the end of this visual line into the next */
+      if (sub + 1 < lines && rx >= wrap_line_start(row, sub + 1))
+        rx = wrap_line_start(row, sub + 1) - 1;
+    }
+  else
+    {
+      at = editor.row_offset + y;
+      rx = editor.col_offset + x;
+      if (at >= editor.num_rows)
+        {
+          at = editor.num_rows - 1;
+          if (editor_row_has_next(at))
+            {
+              editor.cy = editor.num_rows;
+              editor.cx = 0;
+              return;
+            }
+        }
+    }
+  editor.cy = at;
+  editor.cx = editor_row_rx_to_cx(editor_row_load(at), rx);
+}
+
+/* scroll the screen, taking the cursor along if it would go off it */
+void
+editor_mouse_wheel(int lines)
+{
+  int line, top;
+  if (editor.wrap)
+    {
+      wrap_set_top(wrap_top_line() + lines);
+      line = wrap_cursor_screen_line();
+      top = 0;
+    }
+  else
+    {
+      editor.row_offset += lines;
+      if (editor.row_offset > editor.num_rows - 1)
+        editor.row_offset = editor.num_rows - 1;
+      if (editor.row_offset < 0)
+        editor.row_offset = 0;
+      line = editor.cy;
+      top = editor.row_offset;
+    }
+  int rx = editor.rx - (editor.wrap ? 0 : editor.col_offset);
+  if (editor.wrap && editor.cy < editor.num_rows)
+    {
+      int start = 0;
+      wrap_locate(editor_row_load(editor.cy), editor.rx, &start);
+      rx = editor.rx - start;
+    }
+  if (line < top)
+    editor_place_cursor(0, rx);
+  else if (line >= top + editor.window_rows)
+    editor_place_cursor(editor.window_rows - 1, rx);
+}
+
+/* a click on the text puts the cursor there */
+void
+editor_mouse_click(void)
+{
+  if (mouse.y < editor.window_rows)
+    editor_place_cursor(mouse.y, mouse.x);
+}
+
+/* the diff view only moves */
+void
+diff_process_key(int c, int pc)
+{
+  int width = (editor.window_cols - 3) / 2;
+  switch (c)
+    {
+    case 'q':
+      editor_clear_screen();
+      exit(EXIT_SUCCESS);
+    case CTRL('C'):
+      if (pc == CTRL('X'))
+        {
+          editor_clear_screen();
+          exit(EXIT_SUCCESS);
+        }
+      break;
+    case NEXT_LINE:
+      if (! diff_down())
+        editor_ding();
+      break;
+    case MOUSE_WHEEL:
+      for (int n = mouse.lines; n > 0 && diff_down(); n--)
+        ;
+      for (int n = mouse.lines; n < 0 && diff_up(); n++)
+        ;
+      break;
+    case MOUSE_CLICK:
+      /* there's no cursor to put anywhere */
+      break;
+    case PREV_LINE:
+      if (! diff_up())
+        editor_ding();
+      break;
+    case SCROLL_DOWN:
+    case SCROLL_UP:
+      for (int n = editor.window_rows - 4; n > 0; n--)
+        if (! (c == SCROLL_DOWN ? diff_down() : diff_up()))
+          break;
+      break;
+    case BEG_OF_BUF:
+      diff.top = diff.top_off = 0;
+      editor.col_offset = 0;
+      break;
+    case END_OF_BUF:
+      /* the last line at the bottom */
+      if (diff.num_segs == 0)
+        break;
+      diff.top = diff_resolve_tail(diff.num_segs - 1);
+      diff.top_off = diff_seg_lines(&diff.seg[diff.top]) - 1;
+      for (int n = editor.window_rows - 1; n > 0 && diff_up(); n--)
+        ;
+      break;
+    case FORWARD_CHAR:
+      editor.col_offset += width / 2 ? width / 2 : 1;
+      break;
+    case BACKWARD_CHAR:
+      editor.col_offset -= width / 2 ? width / 2 : 1;
+      if (editor.col_offset < 0)
+        editor.col_offset = 0;
+      break;
+    case 'n':
+    case 'p':
+      if (diff.num_segs == 0 || ! diff_find_change(c == 'n'))
+        {
+          editor_ding();
+          editor_set_status_msg("No %s difference",
+                                c == 'n' ? "next" : "previous");
+        }
+      break;
+    case CTRL('X'):
+      break;
+    default:
+      editor_ding();
+      editor_set_status_msg("Diff view is read-only");
+      break;
+    }
+}
+
+/* M-g g, a line of HEX_ROW_SZ bytes, or M-g c, an offset in decimal
+   or 0x hex */
+void
+hex_goto_prompt(bool offset)
+{
+  struct hex_file *hex = editor.hex;
+  char *input = editor_prompt(offset ? "Goto offset: %s" : "Goto line: %s");
+  if (input == NULL)
+    return;
+  bool base16 = input[0] == '0' && (input[1] == 'x' || input[1] == 'X');
+  long long n = strtoll(input, NULL, base16 ? 16 : 10);
+  free(input);
+
+  hex_goto(hex, offset ? n : (n - 1) * HEX_ROW_SZ);
+  off_t row = hex->at / HEX_ROW_SZ;
+  if (row < hex->top || row >= hex->top + editor.window_rows)
+    {
+      hex->top = row - editor.window_rows / 2;
+      if (hex->top < 0)
+        hex->top = 0;
+    }
+}
+
+/* the hex view only moves */
+void
+hex_process_key(int c, int pc)
+{
+  struct hex_file *hex = editor.hex;
+  off_t at = hex->at;
+  off_t page = (off_t) (editor.window_rows - 2) * HEX_ROW_SZ;
+  switch (c)
+    {
+    case 'q':
+      editor_clear_screen();
+      exit(EXIT_SUCCESS);
+    case CTRL('C'):
+      if (pc == CTRL('X'))
+        {
+          editor_clear_screen();
+          exit(EXIT_SUCCESS);
+        }
+      break;
+    case FORWARD_CHAR:
+    case BACKWARD_CHAR:
+      hex_goto(hex, at + (c == FORWARD_CHAR ? 1 : -1));
+      break;
+    case NEXT_LINE:
+    case PREV_LINE:
+      if (c == NEXT_LINE ? at + HEX_ROW_SZ < hex->size
+          : at >= HEX_ROW_SZ)
+        hex_goto(hex, at + (c == NEXT_LINE ? HEX_ROW_SZ : -HEX_ROW_SZ));
+      break;
+    case SCROLL_DOWN:
+    case SCROLL_UP:
+      /* the screen moves, the cursor keeps its place on it */
+      if (c == SCROLL_UP)
+        page = -page;
+      hex->top += page / HEX_ROW_SZ;
+      if (hex->top > hex_num_rows(hex) - 1)
+        hex->top = hex_num_rows(hex) - 1;
+      if (hex->top < 0)
+        hex->top = 0;
+      hex_goto(hex, at + page);
+      break;
+    case MOUSE_WHEEL:
+      {
+        hex->top += mouse.lines;
+        if (hex->top > hex_num_rows(hex) - 1)
+          hex->top = hex_num_rows(hex) - 1;
+        if (hex->top < 0)
+          hex->top = 0;
+        /* the cursor stays on screen, in its column */
+        off_t row = at / HEX_ROW_SZ;
+        if (row < hex->top)
+          hex_goto(hex, at + (hex->top - row) * HEX_ROW_SZ);
+        else if (row >= hex->top + editor.window_rows)
+          hex_goto(hex, at - (row - hex->top - editor.window_rows + 1)
+                   * HEX_ROW_SZ);
+      }
+      break;
+    case MOUSE_CLICK:
+      {
+        if (mouse.y >= editor.window_rows)
+          break;
+        /* on the digits of a byte, or on it in the text */
+        int x = mouse.x - hex_addr_digits(hex->size) - 2;
+        int i = 0;
+        if (x >= HEX_TEXT_COL)
+          i = x - HEX_TEXT_COL;
+        else if (x > 0)
+          i = x / 5 * 2 + (x % 5 >= 2);
+        if (i > HEX_ROW_SZ - 1)
+          i = HEX_ROW_SZ - 1;
+        hex_goto(hex, (hex->top + mouse.y) * HEX_ROW_SZ + i);
+      }
+      break;
+    case MV_BEG_OF_LINE:
+      hex_goto(hex, at - at % HEX_ROW_SZ);
+      break;
+    case MV_END_OF_LINE:
+      hex_goto(hex, at - at % HEX_ROW_SZ + HEX_ROW_SZ - 1);
+      break;
+    case BEG_OF_BUF:
+      hex_goto(hex, 0);
+      break;
+    case END_OF_BUF:
+      hex_goto(hex, hex->size - 1);
+      break;
+    case 'g':
+    case 'c':
+    case GOTO_PREFIX:
+      if (pc == GOTO_PREFIX)
+        {
+          hex_goto_prompt(c == 'c');
+          break;
+        }
+      /* fall through */
+    default:
+      if (c == GOTO_PREFIX || c == CTRL('X'))
+        break;
+      editor_ding();
+      editor_set_status_msg("Hex view is read-only");
+      break;
+    }
+  if (hex->at == at && (c == FORWARD_CHAR || c == BACKWARD_CHAR
+                        || c == NEXT_LINE || c == PREV_LINE))
+    editor_ding();
+}
+
 void
 editor_process_keystroke(void)
 {
   static int c;
   static int pc;
+  /* from C-u, -1 if there was none */
+  static int arg = -1;
 
   pc = c;
   c = editor_read_key();
+  if (diff.active)
+    {
+      diff_process_key(c, pc);
+      return;
+    }
+  if (editor.hex)
+    {
+      hex_process_key(c, pc);
+      return;
+    }
+  if (c == UNIVERSAL_ARG)
+    arg = editor_universal_arg(&c);
+  undo_tick();
+  /* keys after a prefix never self-insert */
+  bool prefixed = pc == CTRL('X') || pc == GOTO_PREFIX;
   
   switch (c)
 	{
 	case CTRL('C'):
 	  if (pc == CTRL('X'))
 		{
+          if (editor.dirty)
+            {
+              char *answer = editor_prompt("Modified buffer exists; "
+                                           "exit anyway? (yes or no) %s");
+              bool yes = answer && strcmp(answer, "yes") == 0;
+              free(answer);
+              c = 0;
+              if (! yes)
+                break;
+            }
+          journal_stop(true);
 		  editor_clear_screen();
 		  exit(EXIT_SUCCESS);
 		}
 	  break;
+    case '\r':
+    case '\n':
+      editor_newline();
+      break;
+    case DEL_BACKWARD_CHAR:
+      editor_delete_char(false);
+      break;
+    case DEL_FORWARD_CHAR:
+    case CTRL('D'):
+      editor_delete_char(true);
+      break;
+    case KILL_LINE:
+      editor_kill_line();
+      break;
+    case UNDO:
+    case REDO:
+      editor_undo(c == REDO);
+      break;
+    case 'u':
+      /* C-x u */
+      if (pc == CTRL('X'))
+        {
+          editor_undo(false);
+          c = 0;
+        }
+      else
+        editor_self_insert(c);
+      break;
 	case FORWARD_CHAR:
 	case BACKWARD_CHAR:
 	case PREV_LINE:
 	case NEXT_LINE:
 	  editor_move_cursor(c);
 	  break;
+    case MOUSE_WHEEL:
+      editor_mouse_wheel(mouse.lines);
+      break;
+    case MOUSE_CLICK:
+      editor_mouse_click();
+      break;
 	case SCROLL_UP:
 	case SCROLL_DOWN:
+      if (editor.wrap)
+        {
+          /* a screen of visual lines, not rows */
+          int lines = editor.window_rows - 2;
+          wrap_set_top(wrap_top_line() + (c == SCROLL_UP ? -lines : lines));
+          editor.cy = editor.row_offset;
+          if (editor.cy < editor.num_rows)
+            {
+              struct editor_row *row = editor_row_load(editor.cy);
+              editor.cx = editor_row_rx_to_cx(row,
+                wrap_line_start(row, editor.wrap_offset));
+            }
+          else
+            editor.cx = 0;
+          break;
+        }
 	  {
         if (c == SCROLL_UP)
           editor.cy = editor.row_offset;
         else
           {
             editor.cy = editor.row_offset + editor.window_rows - 1;
-            if (editor.cy > editor.num_rows)
+            if (editor.cy >= editor.num_rows)
             // one past the end, be careful with newlines at EOF              
-              editor.cy = editor.num_rows;
+              editor_goto_end();
           }
         // gain some idea of prev place        
 		int iterations = editor.window_rows - 4;
@@ -754,12 +5580,75 @@ editor_process_keystroke(void)
       break;
 	case BEG_OF_BUF:
       editor.cx = editor.cy = editor.row_offset = 0;
+      editor.wrap_offset = 0;
 	  break;
 	case END_OF_BUF:
-      editor.cx = 0;
-      editor.cy = editor.num_rows;
+      editor_goto_end();
 	  break;
+    case 'g':
+    case GOTO_PREFIX:
+      /* M-g g or M-g M-g */
+      if (pc == GOTO_PREFIX)
+        {
+          editor_goto_line();
+          c = 0;
+        }
+      else if (c == 'g' && ! prefixed)
+        editor_self_insert(c);
+      break;
+    case CTRL('S'):
+    case CTRL('W'):
+      /* C-x C-s or C-x C-w */
+      if (pc == CTRL('X'))
+        {
+          editor_save(c == CTRL('W'));
+          c = 0;
+        }
+      break;
+    case '(':
+    case ')':
+      /* C-x ( or C-x ) */
+      if (pc == CTRL('X'))
+        {
+          if (c == '(')
+            kbd_macro_start();
+          else
+            kbd_macro_end();
+          c = 0;
+        }
+      else if (! prefixed)
+        editor_self_insert(c);
+      break;
+    case 'e':
+      /* C-x e, then just e to go again */
+      if (pc == CTRL('X') || pc == KBD_MACRO_AGAIN)
+        {
+          kbd_macro_call(arg == -1 ? 1 : arg);
+          c = KBD_MACRO_AGAIN;
+        }
+      else if (! prefixed)
+        editor_self_insert(c);
+      break;
+    case 'x':
+      /* C-x x t */
+      if (pc == CTRL('X'))
+        {
+          if (editor_read_key() == 't')
+            wrap_toggle();
+          c = 0;
+        }
+      else if (! prefixed)
+        editor_self_insert(c);
+      break;
+    default:
+      if (! prefixed && (c == '\t' || (c >= ' ' && c < 0x100 && c != 127)))
+        editor_self_insert(c);
+      break;
 	}
+
+  /* the argument carries over a prefix key to the command after it */
+  if (c != CTRL('X') && c != GOTO_PREFIX)
+    arg = -1;
 }
 
 /* ================ output ================ */
@@ -767,11 +5656,30 @@ editor_process_keystroke(void)
 void
 editor_scroll(void)
 {
+  /* the diff view has a top line and no cursor */
+  if (diff.active)
+    return;
+  if (editor.hex)
+    {
+      off_t row = editor.hex->at / HEX_ROW_SZ;
+      if (row < editor.hex->top)
+        editor.hex->top = row;
+      else if (row >= editor.hex->top + editor.window_rows)
+        editor.hex->top = row - editor.window_rows + 1;
+      return;
+    }
+
   // render at 0 if one past last line
   editor.rx = 0;
   if (editor.cy < editor.num_rows)
-    editor.rx = editor_row_cx_to_rx(&editor.row[editor.cy],
+    editor.rx = editor_row_cx_to_rx(editor_row_load(editor.cy),
                                     editor.cx);
+
+  if (editor.wrap)
+    {
+      wrap_scroll();
+      return;
+    }
   
   // above visibility
   if (editor.cy < editor.row_offset)
@@ -789,13 +5697,246 @@ editor_scroll(void)
 }
 	  
 
+/* like editor_draw_row, but straight from the chars of a chunked row,
+   only the chunk under col and what follows on screen is looked at */
+void
+editor_draw_long_row(struct editor_row *row, int col, int width)
+{
+  struct row_chunk *chunk = editor_row_find_chunk(row, col, true);
+  int i = chunk->off, c = chunk->col;
+  int end = col + width;
+  /* bytes we can pass through as they are, appended in one go */
+  int run = i;
+
+  while (i < row->size && c < end)
+    {
+      uint32_t cp;
+      int n = 1, w = 1;
+      bool tab = false, bad = false;
+      if (row->chars[i] == '\t')
+        {
+          tab = true;
+          w = TAB_STOP_SZ - c % TAB_STOP_SZ;
+        }
+      else if ((unsigned char) row->chars[i] >= 0x80)
+        {
+          if ((n = utf8_decode(&row->chars[i], row->size - i, &cp)) == 0
+              || UTF8_C1(cp))
+            {
+              bad = true;
+              n = 1;
+            }
+          else
+            w = utf8_width(cp);
+        }
+      else if (iscntrl((unsigned char) row->chars[i]))
+        bad = true;
+
+      if (c + w <= col)
+        run = i + n;
+      else if (tab || bad || c < col || c + w > end)
+        {
+          if (i > run)
+            abuf_append(&row->chars[run], i - run);
+          if (bad)
+            abuf_append("?", 1);
+          else
+            /* tabs, and wide chars cut by an edge */
+            for (int from = c < col ? col : c; from < c + w && from < end;
+                 from++)
+              abuf_append(" ", 1);
+          run = i + n;
+        }
+      c += w;
+      i += n;
+    }
+  if (i > run)
+    abuf_append(&row->chars[run], i - run);
+}
+
+/* append render[lo, hi) of a row in its colors, back to the default
+   color at the end so every line stands on its own */
+void
+editor_draw_render(struct editor_row *row, int lo, int hi)
+{
+  if (row->hl == NULL)
+    {
+      abuf_append(&row->render[lo], hi - lo);
+      return;
+    }
+
+  int cur = HL_NORMAL;
+  int run = lo;
+  for (int i = lo; i <= hi; i++)
+    if (i == hi || row->hl[i] != cur)
+      {
+        if (i > run)
+          abuf_append(&row->render[run], i - run);
+        if (i == hi)
+          break;
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%dm",
+                           editor_hl_to_color(row->hl[i]));
+        abuf_append(buf, len);
+        cur = row->hl[i];
+        run = i;
+      }
+  if (cur != HL_NORMAL)
+    abuf_append("\x1b[39m", 5);
+}
+
+/* append the columns [col, col + width) of a row, wide chars cut by
+   either edge become spaces */
+void
+editor_draw_row(struct editor_row *row, int col, int width)
+{
+  if (row->chunk)
+    {
+      editor_draw_long_row(row, col, width);
+      return;
+    }
+
+  if (row->rcol == NULL)
+    {
+      int len = row->rsize - col;
+      // maybe they're on a longer line than ours, ours goes to 0
+      if (len < 0)
+        len = 0;
+      else if (len > width)
+        len = width;
+      if (col < row->rsize)
+        editor_draw_render(row, col, col + len);
+      return;
+    }
+
+  int lo = editor_row_col_to_ri(row, col);
+  int hi = editor_row_col_to_ri(row, col + width);
+  if (lo < row->rsize)
+    for (int pad = row->rcol[lo] - col; pad > 0; pad--)
+      abuf_append(" ", 1);
+  /* the last char may stick out past the edge */
+  int tail = 0;
+  if (hi > lo && row->rcol[hi] > col + width)
+    {
+      int end = hi;
+      hi = editor_row_col_to_ri(row, row->rcol[hi - 1]);
+      tail = col + width - row->rcol[end - 1];
+      if (hi < lo)
+        hi = lo;
+    }
+  if (hi > lo)
+    editor_draw_render(row, lo, hi);
+  while (tail-- > 0)
+    abuf_append(" ", 1);
+}
+
+/* a row's part of a diff pane, padded out to width */
+void
+diff_draw_pane(struct editor_row *row, const char *color, int width)
+{
+  int drawn = 0;
+  if (row)
+    {
+      if (color)
+        abuf_append(color, strlen(color));
+      editor_draw_row(row, editor.col_offset, width);
+      if (color)
+        abuf_append("\x1b[39m", 5);
+      drawn = row->rcols - editor.col_offset;
+      if (drawn < 0)
+        drawn = 0;
+      else if (drawn > width)
+        drawn = width;
+    }
+  for (; drawn < width; drawn++)
+    abuf_append(" ", 1);
+}
+
+/* the left file and the right one next to each other, changes in red
+   on the left and green on the right */
+void
+diff_draw_rows(void)
+{
+  int width = (editor.window_cols - 3) / 2;
+  int i = diff.top, off = diff.top_off;
+  for (int j = 0; j < editor.window_rows; j++)
+    {
+      if (i < diff.num_segs)
+        {
+          struct diff_seg *seg = &diff.seg[i];
+          struct editor_row *left = NULL, *right = NULL;
+          if (off < seg->n)
+            left = editor_row_load(seg->a + off);
+          if (off < seg->m)
+            right = &diff.row[seg->b + off];
+          char mark = ' ';
+          if (seg->type == DIFF_CHANGE)
+            mark = left && right ? '|' : left ? '<' : '>';
+          bool change = seg->type == DIFF_CHANGE;
+
+          diff_draw_pane(left, change ? "\x1b[31m" : NULL, width);
+          char gutter[3] = { ' ', mark, ' ' };
+          abuf_append(gutter, 3);
+          if (right)
+            diff_draw_pane(right, change ? "\x1b[32m" : NULL, width);
+
+          if (++off >= diff_seg_lines(seg))
+            {
+              off = 0;
+              if (++i < diff.num_segs)
+                diff_resolve_head(i);
+            }
+        }
+      abuf_append(EOL, EOL_SZ);
+    }
+}
+
+/* only the lines on screen, straight from the mapping */
+void
+hex_draw_rows(void)
+{
+  struct hex_file *hex = editor.hex;
+  int digits = hex_addr_digits(hex->size);
+  char line[20 + HEX_TEXT_COL + HEX_ROW_SZ];
+  for (int j = 0; j < editor.window_rows; j++)
+    {
+      off_t off = (hex->top + j) * HEX_ROW_SZ;
+      if (off < hex->size)
+        {
+          int n = hex->size - off < HEX_ROW_SZ ? hex->size - off
+            : HEX_ROW_SZ;
+          int len = hex_format_row(&hex->map[off], n, off, digits, line);
+          if (len > editor.window_cols)
+            len = editor.window_cols;
+          abuf_append(line, len);
+        }
+      abuf_append(EOL, EOL_SZ);
+    }
+}
+
 void
 editor_draw_rows(void)
 {
+  if (diff.active)
+    {
+      diff_draw_rows();
+      return;
+    }
+  if (editor.hex)
+    {
+      hex_draw_rows();
+      return;
+    }
+
+  int filerow = editor.row_offset, sub = editor.wrap_offset;
+  /* where the visual line starts (-1 for not worked out yet), and the
+     render byte for that */
+  int start = -1, ri = 0;
   for (int j = 0; j < editor.window_rows; j++)
 	{
 	  // some rows with no content ... (past text buffer)
-	  int filerow = j + editor.row_offset;
+      if (! editor.wrap)
+        filerow = j + editor.row_offset;
 	  
 	  if (filerow >= editor.num_rows)
 		{
@@ -814,17 +5955,33 @@ editor_draw_rows(void)
 			  abuf_append(welcome, welcomelen);
 			}
 		}
+      else if (editor.wrap)
+        {
+          /* a window's width of the row at a time, less if a wide char
+             doesn't fit */
+          struct editor_row *row = editor_hl_row(filerow);
+          if (start == -1)
+            {
+              start = wrap_line_start(row, sub);
+              ri = editor_row_col_to_ri(row, start);
+            }
+          int next = wrap_next_start(row, &ri, start);
+          editor_draw_row(row, start,
+                          next == -1 ? editor.window_cols : next - start);
+          start = next;
+          if (++sub >= wrap_refresh(filerow) || next == -1)
+            {
+              filerow++;
+              sub = 0;
+              start = -1;
+            }
+        }
 	  else
 		{
 		  /* display starting a certain number of columns in --
              horizontal scroll */
-		  int len = editor.row[filerow].rsize - editor.col_offset;
-		  // maybe they're on a longer line than ours, ours goes to 0
-		  if (len < 0)
-			len = 0;
-		  else if (len > editor.window_cols)
-			len = editor.window_cols;
-		  abuf_append(&editor.row[filerow].render[editor.col_offset], len);
+          editor_draw_row(editor_hl_row(filerow), editor.col_offset,
+                          editor.window_cols);
 		}
 	  
       abuf_append(EOL, EOL_SZ);
@@ -836,11 +5993,37 @@ editor_draw_status_bar(void)
 {
   abuf_append(START_INVERT_TEXT, START_INVERT_TEXT_SZ);
   char status[80];
-  int len = snprintf(status, sizeof(status), " -:**-  %.20s -- line %d/%d",
-                     editor.filename ? editor.filename : "*no-file*",
-                     editor.cy + 1,
-                     editor.num_rows
-                     );
+  int len;
+  if (diff.active)
+    {
+      int line = 0;
+      if (diff.num_segs)
+        {
+          struct diff_seg *seg = &diff.seg[diff.top];
+          line = seg->a + (diff.top_off < seg->n ? diff.top_off : seg->n);
+        }
+      len = snprintf(status, sizeof(status),
+                     " -:%%%%-  %.20s <> %.20s -- line %d/%d  (Diff)",
+                     editor.filename, diff.filename, line + 1,
+                     editor.num_rows);
+    }
+  else if (editor.hex)
+    len = snprintf(status, sizeof(status),
+                   " -:%%%%-  %.20s -- offset 0x%llx/0x%llx  (Hex)",
+                   editor.filename, (unsigned long long) editor.hex->at,
+                   (unsigned long long) editor.hex->size);
+  else
+    len = snprintf(status, sizeof(status),
+                   " -:%s-  %.20s%s -- line %d/%d  (%s)",
+                   editor.gz ? "%%" : editor.dirty ? "**" : "--",
+                   editor.filename ? editor.filename : "*no-file*",
+                   editor.gz && editor.gz->corrupt ? " [corrupt]" : "",
+                   editor.cy + 1,
+                   editor.num_rows,
+                   editor.syntax ? editor.syntax->filetype : "Fundamental"
+                   );
+  if (len >= (int) sizeof(status))
+    len = sizeof(status) - 1;
   if (len > editor.window_cols)
     len = editor.window_cols;
   abuf_append(status, len);
@@ -863,7 +6046,15 @@ editor_draw_msg_bar(void)
 void
 editor_refresh_screen(void)
 {
+  /* a macro draws once, when it's done */
+  if (macro.replaying)
+    return;
+  /* the edits of the last command, before they're shown */
+  journal_wake();
+  if (editor.hex)
+    hex_check_size(editor.hex);
   editor_scroll();
+  editor.hl_budget = HL_SYNC_ROWS;
 
   ab.buf = NULL;
   ab.len = 0;
@@ -882,6 +6073,26 @@ editor_refresh_screen(void)
   cy/rx references our position within the text file, not on the screen */
   int cursor_pos_y = editor.cy - editor.row_offset + 1;
   int cursor_pos_x = editor.rx - editor.col_offset + 1;
+  if (diff.active)
+    cursor_pos_y = cursor_pos_x = 1;
+  else if (editor.hex)
+    {
+      /* on the byte's high digit */
+      int i = editor.hex->at % HEX_ROW_SZ;
+      cursor_pos_y = editor.hex->at / HEX_ROW_SZ - editor.hex->top + 1;
+      cursor_pos_x = hex_addr_digits(editor.hex->size) + 2
+        + HEX_COL_DIGITS(i) + 1;
+    }
+  else if (editor.wrap)
+    {
+      int start = 0;
+      if (editor.cy < editor.num_rows)
+        wrap_locate(editor_row_load(editor.cy), editor.rx, &start);
+      cursor_pos_y = wrap_cursor_screen_line() + 1;
+      cursor_pos_x = editor.rx - start + 1;
+      if (cursor_pos_x > editor.window_cols)
+        cursor_pos_x = editor.window_cols;
+    }
   snprintf(buf, sizeof(buf), MV_CURSOR_COORD_ARGS_YX, cursor_pos_y, cursor_pos_x);
   abuf_append(buf, strlen(buf));
 		   
@@ -906,12 +6117,13 @@ update_window_size(void)
                       
 void handle_sigwinch(int sig [[maybe_unused]])
 {
-  update_window_size();
-  editor_refresh_screen();
+  /* the screen may be half drawn, leave it to editor_read_key */
+  window_resized = 1;
 }
 
+/* an empty buffer */
 void
-init_editor(void)
+init_editor_state(void)
 {
   /* 0-indexed within text file */
   editor.cx = editor.cy = 0;
@@ -921,16 +6133,565 @@ init_editor(void)
   editor.num_rows = 0;
   editor.row_offset = 0;
   editor.col_offset = 0;
+
+  editor.wrap = false;
+  editor.wrap_offset = 0;
+  editor.wrap_block = NULL;
+  editor.wrap_row_tree = NULL;
+  editor.wrap_tree = NULL;
+  editor.wrap_blocks = 0;
+  editor.wrap_block_cap = 0;
+  editor.wrap_tree_rows = -1;
+
+  editor.syntax = NULL;
+  editor.hl_valid_to = 0;
+  editor.hl_known_to = 0;
+
+  editor.fd = -1;
+  editor.file_size = 0;
+  editor.file_mtime = (struct timespec) { 0 };
+  editor.file_dev = 0;
+  editor.file_ino = 0;
+  editor.dirty = false;
+  editor.eol = 1;
+  editor.edits = 0;
   
   editor.row = NULL;
+  editor.row_cap = 0;
+  editor.gz = NULL;
+  editor.hex = NULL;
   editor.filename = NULL;
   editor.status_msg[0] = '\0';
   editor.status_msg_time = 0;
 
   //  editor.final_row_newline = false;
-  
+}
+
+/* size up the terminal and follow it when it's resized */
+void
+init_window(void)
+{
   update_window_size();
-  signal(SIGWINCH, handle_sigwinch);
+
+  /* signal() is one-shot and interrupts reads with _POSIX_C_SOURCE */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigwinch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die(DIE_ERROR_FMT, "sigaction");
+}
+
+void
+init_editor(void)
+{
+  init_editor_state();
+  init_window();
+}
+
+/* ================ server ================ */
+
+/* le -S keeps the files it has been asked for in memory, rows, renders
+ * and compressed file indexes included. le -c FILE hands its terminal
+ * over the server's socket, and the server passes it on to the keeper
+ * of that file: a process forked to read it, which then forks an editor
+ * for every client that starts out with the file already read. the
+ * fork shares the keeper's memory until it writes to it, so any number
+ * of clients on one file cost about one copy of it, and their edits are
+ * their own until saved. reading happens in the keeper, so a file that
+ * can't be read takes only its keeper down and the client reads it
+ * itself, to say why. a file that changed on disk since is read again
+ * by a new keeper, and past SERVER_BUFS_MAX files the one asked for
+ * least recently lets go of its keeper. */
+
+#define SERVER_BUFS_MAX 16
+
+struct server_buffer
+{
+  /* absolute, as the client sent it */
+  char *path;
+  /* the file as it was when its keeper was started */
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  /* our end of the socket to the keeper, which exits once it's closed */
+  int sock;
+  /* when a client last asked for it */
+  unsigned long used;
+};
+
+struct server_cache
+{
+  struct server_buffer buf[SERVER_BUFS_MAX];
+  int num_bufs;
+  unsigned long tick;
+  /* the socket clients connect to */
+  int sock;
+  /* the editor a client is attached to, for passing on resizes */
+  pid_t editor_pid;
+  /* in an editor, the connection its client waits on */
+  int conn;
+} server = { .sock = -1, .conn = -1 };
+
+/* where the server listens, in a directory only we may use. NULL if
+   it's someone else's */
+const char *
+server_socket_path(bool create)
+{
+  static char path[sizeof ((struct sockaddr_un *) 0)->sun_path];
+  char dir[sizeof path - sizeof "/server"];
+  const char *run = getenv("XDG_RUNTIME_DIR");
+  if (run && *run)
+    snprintf(dir, sizeof dir, "%s/le", run);
+  else
+    snprintf(dir, sizeof dir, "/tmp/le%u", (unsigned) getuid());
+  if (create && mkdir(dir, 0700) == -1 && errno != EEXIST)
+    die(DIE_ERROR_FMT, "mkdir");
+
+  struct stat st;
+  if (lstat(dir, &st) == -1 || ! S_ISDIR(st.st_mode)
+      || st.st_uid != getuid() || (st.st_mode & 077))
+    return NULL;
+  snprintf(path, sizeof path, "%s/server", dir);
+  return path;
+}
+
+int
+server_connect(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock != -1 && connect(sock, (struct sockaddr *) &addr,
+                            sizeof addr) == -1)
+    {
+      close(sock);
+      sock = -1;
+    }
+  return sock;
+}
+
+/* msg along with nfds file descriptors */
+bool
+server_send(int sock, const char *msg, int len, const int *fds, int nfds)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+  } ctl;
+  memset(&ctl, 0, sizeof ctl);
+  struct iovec iov = { (char *) msg, len };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctl.buf,
+    .msg_controllen = CMSG_SPACE(sizeof(int) * nfds),
+  };
+  struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+  memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+  /* a keeper that's gone is an error, not a SIGPIPE */
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0, on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof on);
+#endif
+  return sendmsg(sock, &mh, flags) == len;
+}
+
+/* nfds file descriptors and the message after them: a directory and a
+   file, each ending in a NUL. whatever came along is closed if it
+   isn't that */
+bool
+server_recv(int conn, char *msg, int size, int *fds, int nfds)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+  } ctl;
+  struct iovec iov = { msg, size - 1 };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctl.buf,
+    .msg_controllen = sizeof ctl.buf,
+  };
+  ssize_t n = recvmsg(conn, &mh, 0);
+  if (n <= 0)
+    return false;
+
+  int got = 0;
+  bool ok = ! (mh.msg_flags & MSG_CTRUNC);
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c))
+    {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        {
+          ok = false;
+          continue;
+        }
+      int in = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (int i = 0; i < in; i++)
+        {
+          int fd;
+          memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof fd);
+          if (got < nfds)
+            fds[got++] = fd;
+          else
+            {
+              close(fd);
+              ok = false;
+            }
+        }
+    }
+
+  /* the names may come in more than one piece */
+  int len = n, nuls = 0;
+  for (int i = 0; i < len; i++)
+    nuls += msg[i] == '\0';
+  while (ok && got == nfds && nuls < 2)
+    {
+      if (len == size - 1 || (n = read(conn, &msg[len], size - 1 - len)) <= 0)
+        ok = false;
+      else
+        {
+          for (int i = len; i < len + n; i++)
+            nuls += msg[i] == '\0';
+          len += n;
+        }
+    }
+  if (! ok || got != nfds)
+    {
+      while (got > 0)
+        close(fds[--got]);
+      return false;
+    }
+  msg[len] = '\0';
+  return true;
+}
+
+/* let go of a file, its keeper exits once it has seen to the clients
+   already passed to it */
+void
+server_evict(struct server_buffer *buf)
+{
+  if (buf->sock != -1)
+    close(buf->sock);
+  free(buf->path);
+  *buf = server.buf[--server.num_bufs];
+}
+
+/* the file at path as the server knows it, with sock -1 if it's new and
+   needs a keeper. NULL if it's one to leave to the client */
+struct server_buffer *
+server_buffer(char *path)
+{
+  struct stat st;
+  if (stat(path, &st) == -1 || ! S_ISREG(st.st_mode))
+    return NULL;
+
+  for (int i = 0; i < server.num_bufs; i++)
+    {
+      struct server_buffer *buf = &server.buf[i];
+      if (strcmp(buf->path, path) != 0)
+        continue;
+      if (buf->dev == st.st_dev && buf->ino == st.st_ino
+          && buf->size == st.st_size && mtime_same(&st, buf->mtime))
+        {
+          buf->used = ++server.tick;
+          return buf;
+        }
+      /* editors still using the old one have their own copy */
+      server_evict(buf);
+      break;
+    }
+
+  if (server.num_bufs == SERVER_BUFS_MAX)
+    {
+      struct server_buffer *lru = &server.buf[0];
+      for (int i = 1; i < server.num_bufs; i++)
+        if (server.buf[i].used < lru->used)
+          lru = &server.buf[i];
+      server_evict(lru);
+    }
+
+  char *copy = strdup(path);
+  if (copy == NULL)
+    return NULL;
+  struct server_buffer *buf = &server.buf[server.num_bufs++];
+  buf->path = copy;
+  buf->dev = st.st_dev;
+  buf->ino = st.st_ino;
+  buf->size = st.st_size;
+  buf->mtime = stat_mtime(&st);
+  buf->sock = -1;
+  buf->used = ++server.tick;
+  return buf;
+}
+
+/* at exit, tell the client we left its terminal the way we found it */
+void
+server_detach(void)
+{
+  /* not gonna call "die" to exit in an atexit handler */
+  write(server.conn, "", 1);
+}
+
+/* in the fork, take over the client's terminal and open its file */
+void
+server_attach(int conn, int fds[2], char *cwd, char *file, bool cached)
+{
+  if (dup2(fds[0], STDIN_FILENO) == -1 || dup2(fds[1], STDOUT_FILENO) == -1)
+    die(DIE_ERROR_FMT, "dup2");
+  for (int i = 0; i < 2; i++)
+    if (fds[i] > STDOUT_FILENO)
+      close(fds[i]);
+  if (chdir(cwd) == -1)
+    die(DIE_ERROR_FMT, "chdir");
+  /* the server ignored its children, we wait for ours */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+  /* resizes reach the client, it passes them on. conn stays open until
+     we exit, which is what the client waits for */
+  pid_t self = getpid();
+  if (write(conn, &self, sizeof self) != sizeof self)
+    die(DIE_ERROR_FMT, "write");
+  /* registered first, so it runs after the terminal is put back */
+  server.conn = conn;
+  atexit(server_detach);
+
+  if (cached)
+    {
+      if (editor.gz)
+        gz_reopen(editor.gz, file);
+    }
+  else
+    init_editor_state();
+  enable_raw_mode();
+  init_window();
+  if (cached)
+    journal_replay();
+  else if (*file)
+    editor_open(file);
+}
+
+/* in the keeper, read the file and fork an editor for every client the
+   server passes on. returns only in one of those */
+void
+server_keep(int sock, char *path)
+{
+  init_editor_state();
+  editor_load(path);
+
+  while (1)
+    {
+      char msg[2 * PATH_MAX + 2];
+      /* the client's connection, then its terminal */
+      int fds[3];
+      if (! server_recv(sock, msg, sizeof msg, fds, 3))
+        exit(EXIT_SUCCESS);
+      char *file = &msg[strlen(msg) + 1];
+
+      pid_t pid = fork();
+      if (pid == 0)
+        {
+          close(sock);
+          server_attach(fds[0], &fds[1], msg, file, true);
+          return;
+        }
+      /* if the fork failed, the client sees us hang up */
+      for (int i = 0; i < 3; i++)
+        close(fds[i]);
+    }
+}
+
+/* fork a keeper for buf. returns only in the keeper, which has nothing
+   of the server's open but its own end of the socket */
+bool
+server_spawn(struct server_buffer *buf, const int *open_fds, int n)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    return false;
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      close(sv[0]);
+      close(server.sock);
+      for (int i = 0; i < server.num_bufs; i++)
+        if (server.buf[i].sock != -1)
+          close(server.buf[i].sock);
+      for (int i = 0; i < n; i++)
+        close(open_fds[i]);
+      server_keep(sv[1], buf->path);
+      return true;
+    }
+  close(sv[1]);
+  if (pid == -1)
+    close(sv[0]);
+  else
+    buf->sock = sv[0];
+  return false;
+}
+
+/* serve clients until killed. returns only in the editor forked off for
+   one, with its terminal and file ready */
+void
+server_run(void)
+{
+  const char *path = server_socket_path(true);
+  if (path == NULL)
+    die(DIE_MSG_FMT, "the socket directory isn't ours alone");
+  int sock = server_connect(path);
+  if (sock != -1)
+    die(DIE_MSG_FMT, "a server is already running");
+  unlink(path);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, path);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+      || bind(sock, (struct sockaddr *) &addr, sizeof addr) == -1
+      || listen(sock, 16) == -1)
+    die(DIE_ERROR_FMT, "socket");
+  server.sock = sock;
+
+  /* nobody waits for the keepers or the editors */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL) == -1)
+    die(DIE_ERROR_FMT, "sigaction");
+
+  while (1)
+    {
+      int conn = accept(sock, NULL, NULL);
+      if (conn == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          die(DIE_ERROR_FMT, "accept");
+        }
+      char msg[2 * PATH_MAX + 2];
+      int fds[2];
+      if (! server_recv(conn, msg, sizeof msg, fds, 2))
+        {
+          close(conn);
+          continue;
+        }
+      char *file = &msg[strlen(msg) + 1];
+      int len = file + strlen(file) + 1 - msg;
+      int pass[3] = { conn, fds[0], fds[1] };
+
+      struct server_buffer *buf = *file ? server_buffer(file) : NULL;
+      if (buf && buf->sock == -1)
+        {
+          if (server_spawn(buf, pass, 3))
+            return;
+          if (buf->sock == -1)
+            {
+              server_evict(buf);
+              buf = NULL;
+            }
+        }
+      if (buf && ! server_send(buf->sock, msg, len, pass, 3))
+        {
+          /* its keeper died, maybe on reading it: the client's own
+             editor reads it instead, and tells why if it can't */
+          server_evict(buf);
+          buf = NULL;
+        }
+
+      if (buf == NULL)
+        {
+          pid_t pid = fork();
+          if (pid == 0)
+            {
+              close(sock);
+              for (int i = 0; i < server.num_bufs; i++)
+                close(server.buf[i].sock);
+              server.num_bufs = 0;
+              server_attach(conn, fds, msg, file, false);
+              return;
+            }
+        }
+      /* if the fork failed, the client sees us hang up */
+      for (int i = 0; i < 3; i++)
+        close(pass[i]);
+    }
+}
+
+void
+client_forward_winch(int sig [[maybe_unused]])
+{
+  kill(server.editor_pid, SIGWINCH);
+}
+
+/* hand our terminal to the server and wait until its editor is done
+   with it. false if there's no server to ask, or nobody took it */
+bool
+client_attach(const char *file)
+{
+  const char *path = server_socket_path(false);
+  int sock = path ? server_connect(path) : -1;
+  if (sock == -1)
+    return false;
+  if (! isatty(STDIN_FILENO) || ! isatty(STDOUT_FILENO)
+      || tcgetattr(STDIN_FILENO, &editor.orig_termios) == -1)
+    die(DIE_MSG_FMT, "stdin and stdout must be terminal devices");
+
+  char msg[2 * PATH_MAX + 2];
+  if (getcwd(msg, PATH_MAX) == NULL)
+    die(DIE_ERROR_FMT, "getcwd");
+  int len = strlen(msg) + 1;
+  /* the server knows files by their absolute names */
+  char *name = &msg[len];
+  if (file == NULL)
+    *name = '\0';
+  else if (realpath(file, name) == NULL)
+    snprintf(name, PATH_MAX, "%s", file);
+  len += strlen(name) + 1;
+
+  int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+  if (! server_send(sock, msg, len, fds, 2))
+    die(DIE_ERROR_FMT, "sendmsg");
+
+  /* a keeper that died reading the file never gets that far */
+  if (read(sock, &server.editor_pid, sizeof server.editor_pid)
+      != sizeof server.editor_pid)
+    {
+      close(sock);
+      return false;
+    }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = client_forward_winch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die(DIE_ERROR_FMT, "sigaction");
+  /* it says goodbye on its way out, unless something killed it */
+  bool clean = false;
+  char byte;
+  while (read(sock, &byte, 1) > 0)
+    clean = true;
+  close(sock);
+  if (! clean)
+    {
+      disable_raw_mode();
+      die(DIE_MSG_FMT, "the editor died");
+    }
+  return true;
 }
 
 int
@@ -938,15 +6699,44 @@ main(int argc, char *argv[])
 {
   INIT_LOG("le.log");
   progname = argv[0];
-  enable_raw_mode();
-  init_editor();
 
-  if (argc == 2)
-	editor_open(argv[1]);
-  else if (argc != 1)
+  int opt;
+  bool want_diff = false, serve = false, attach = false;
+  while ((opt = getopt(argc, argv, "dScx")) != -1)
+    if (opt == 'd')
+      want_diff = true;
+    else if (opt == 'x')
+      hex_forced = true;
+    else if (opt == 'S')
+      serve = true;
+    else if (opt == 'c')
+      attach = true;
+    else
+      die(DIE_MSG_FMT, "bad usage");
+  int args = argc - optind;
+  if (want_diff + serve + attach + hex_forced > 1
+      || (want_diff && args != 2)
+      || (serve && args != 0) || (! want_diff && args > 1))
     die(DIE_MSG_FMT, "bad usage");
 
-  editor_set_status_msg("C-x C-c to quit");
+  if (serve)
+    server_run();
+  else if (attach && client_attach(args ? argv[optind] : NULL))
+    exit(EXIT_SUCCESS);
+  else
+    {
+      /* with no server, le -c is just le */
+      enable_raw_mode();
+      init_editor();
+      if (want_diff)
+        diff_open(argv[optind], argv[optind + 1]);
+      else if (args == 1)
+        editor_open(argv[optind]);
+    }
+
+  /* unless opening the file had more to say */
+  if (editor.status_msg[0] == '\0')
+    editor_set_status_msg("C-x C-c to quit");
 
   while (1)
 	{